@@ -18,6 +18,19 @@
 #	error Please #define COMM_NUM_CHANNELS in commlib_cfg.h
 #endif /* COMM_NUM_CHANNELS */
 
+#if (defined COMM_PROCESS && !defined COMM_PTHREAD)
+#	error COMM_PROCESS builds on COMM_PTHREAD, please define both
+#endif
+#if (defined COMM_FIBER && (!defined COMM_PTHREAD || defined COMM_PROCESS))
+#	error COMM_FIBER builds on COMM_PTHREAD, without COMM_PROCESS
+#endif
+#if (defined COMM_PROCESS && defined COMM_CFG_USE_MALLOC)
+#	error COMM_PROCESS needs heaps in shared memory, no COMM_CFG_USE_MALLOC
+#endif
+#if (defined COMM_CFG_CTYPE_SOCKET && !defined COMM_PTHREAD)
+#	undef COMM_CFG_CTYPE_SOCKET	/* needs an operating system */
+#endif
+
 #if (defined COMM_EPIPHANY && !defined __epiphany__)
 #	define COMM_ON_HOST
 #elif (defined COMM_EPIPHANY && defined __epiphany__)
@@ -40,14 +53,29 @@ typedef enum {
 #ifdef COMM_CFG_CTYPE_HOST
 	COMM_CTYPE_HOST,		/* shared memory buffer */
 #endif /* COMM_CFG_CTYPE_HOST */
+#ifdef COMM_CFG_CTYPE_SOCKET
+	COMM_CTYPE_SOCKET,		/* stream socket, any two processes */
+#endif /* COMM_CFG_CTYPE_SOCKET */
 } comm_ctype_t;
 
+/* table slot: pointer or shm offset, always 64 bits wide
+   NOTE: keeps the table layout independent of pointer sizes */
+typedef union {
+	void*    ptr;			/* local pointer (port, descriptor) */
+	uint64_t off;			/* offset into shared memory        */
+} COMM_ALIGN(8) comm_ptr_t;
+
 typedef struct {
-	int32_t  core;
-	void*    dptr;			/* NOTE: assumes 32-bit pointers */
-	void*    hptr;			/*       on both sides!          */
+	int32_t    core;
+	comm_ptr_t dptr;		/* device side */
+	comm_ptr_t hptr;		/* host side   */
 } COMM_ALIGN(8) comm_address_t;
 
+/* channel flags */
+#define COMM_FLAG_BUF_AT_SRC  0x1	/* ring buffer allocated by source */
+#define COMM_FLAG_RECORD      0x2	/* log tokens written (pthreads) */
+#define COMM_FLAG_RECORD_TIME 0x4	/* same, with timestamps */
+
 /* channel description */
 typedef struct {
 	comm_ctype_t   type;		/* channel type */
@@ -55,6 +83,7 @@ typedef struct {
 	comm_address_t dst;		/* destination  */
 	uint32_t       tsize;		/* token size   */
 	uint32_t       tnum;		/* number of tokens per buffer */
+	uint32_t       flags;		/* COMM_FLAG_*  */
 } COMM_ALIGN(8) comm_channel_t;
 
 #ifdef COMM_CFG_CTYPE_HOST
@@ -62,10 +91,28 @@ typedef struct {
 	typedef struct {
 		int32_t rp;
 		int32_t wp;
+		int32_t wait;	/* host waits for rp/wp updates */
+		int32_t efd;	/* eventfd to wake host (pthreads) */
+		int32_t eos;	/* writer closed, set after its last wp */
 		uint8_t COMM_ALIGN(8) buf[];
 	} COMM_ALIGN(8) COMM_PACKED comm_chost_shm_t;
 #endif /* COMM_CFG_CTYPE_HOST */
 
+/* core barrier, see comm_barrier(); lives in memory all cores reach
+   (shm), zeroed before first use. Threads find each flag on its own
+   cache line. On Epiphany, e_barrier() is faster than polling DRAM */
+#ifdef COMM_PTHREAD
+	#define COMM_BARRIER_ALIGN 64
+#else
+	#define COMM_BARRIER_ALIGN 8
+#endif
+typedef struct {
+	struct {
+		volatile uint32_t flag;	/* sense of the core's last arrival */
+	} COMM_ALIGN(COMM_BARRIER_ALIGN) arrive[COMM_CFG_BARRIER_CORES];
+	volatile uint32_t COMM_ALIGN(COMM_BARRIER_ALIGN) sense;
+} COMM_ALIGN(COMM_BARRIER_ALIGN) comm_barrier_t;
+
 /* ==================================================================
    = host-specific parts                                            =
    ================================================================== */
@@ -73,37 +120,195 @@ typedef struct {
 	/* Host API declaration */
 	int  comm_host_init  (comm_channel_t[]);
 	void comm_host_handle(comm_channel_t[], void*);
+	void comm_host_flush (comm_channel_t[], void*);
+	void comm_host_close (comm_channel_t[], void*);
+	void comm_host_wait  (comm_channel_t[], void*);
+	int  comm_host_done  (comm_channel_t[]);
+	void comm_host_start (comm_channel_t[], void*, const int[]);
 	void comm_host_dump  (comm_channel_t[]);
+	#ifdef COMM_PTHREAD
+	void* comm_host_alloc(size_t);
+	int   comm_host_attach(comm_channel_t[], int, size_t);
+	#endif
+	#ifdef COMM_PROCESS
+	/* heap space for core processes, behind the region returned by
+	   comm_host_alloc() and shared the same way */
+	typedef struct {
+		volatile uint64_t used;
+		uint64_t          size;
+		uint8_t COMM_ALIGN(64) mem[];
+	} comm_arena_t;
+	extern comm_arena_t *comm_host_arena;
+	#endif
+
+	/* token log (COMM_FLAG_RECORD, COMM_HOST_REPLAY): header, then one
+	   record per comm_write() call: comm_rec_t, uint64_t timestamp in ns
+	   (COMM_FLAG_RECORD_TIME only), tokens */
+	#define COMM_REC_MAGIC "COMMREC1"
+	typedef struct {
+		char     magic[8];
+		uint32_t tsize;
+		uint32_t flags;	/* COMM_FLAG_RECORD_TIME */
+	} COMM_PACKED comm_rec_hdr_t;
+
+	typedef struct {
+		uint64_t index;	/* first token of record */
+		uint32_t count;	/* tokens in record */
+	} COMM_PACKED comm_rec_t;
 
 	/* Table initializer helpers */
 	#ifdef COMM_CFG_CTYPE_DEFAULT
 		#define DEFAULT(FROM, TO, TSIZE, TNUM) \
 			{ COMM_CTYPE_DEFAULT,          \
-			  { FROM, 0, 0 },              \
-			  { TO,   0, 0 },              \
+			  { FROM, { 0 }, { 0 } },      \
+			  { TO,   { 0 }, { 0 } },      \
+			  TNUM, TSIZE, }
+
+		/* same, but ring buffer lives with the producer */
+		#define DEFAULT_AT_SRC(FROM, TO, TSIZE, TNUM) \
+			{ COMM_CTYPE_DEFAULT,                 \
+			  { FROM, { 0 }, { 0 } },             \
+			  { TO,   { 0 }, { 0 } },             \
+			  TNUM, TSIZE, COMM_FLAG_BUF_AT_SRC, }
+	#endif
+
+	#ifdef COMM_CFG_CTYPE_SOCKET
+		/* ends in different processes, possibly on different machines;
+		   ADDR is "unix:PATH" or "tcp:HOST:PORT" (destination listens,
+		   source connects) or "pair" (both ends in this process) */
+		#define SOCKET(FROM, TO, TSIZE, TNUM, ADDR)                   \
+			{ COMM_CTYPE_SOCKET,                                  \
+			  { FROM, { 0 }, { .ptr = &((comm_ctype_socket_dsc_t) \
+			      { (-1), ADDR }) } },                            \
+			  { TO,   { 0 }, { .ptr = &((comm_ctype_socket_dsc_t) \
+			      { (-1), ADDR }) } },                            \
 			  TNUM, TSIZE, }
+
+		/* descriptor type, one per end; a connected socket in 'fd'
+		   is used as is */
+		typedef struct {
+			int  fd;	/* connected socket, -1: use 'addr' */
+			char *addr;	/* address, see SOCKET() */
+		} comm_ctype_socket_dsc_t;
 	#endif
 
 	#ifdef COMM_CFG_CTYPE_HOST
 		#define HOST_INPUT(FILENAME, CORE, BUF, TSIZE, TNUM)         \
-			{ COMM_CTYPE_HOST,                                   \
-			  { (-1), (void*)offsetof(shm_t, BUF),               \
-			    &((comm_ctype_host_dsc_t) { (-1), FILENAME }) }, \
-			  { CORE },                                          \
-			  TNUM, TSIZE, }
+			HOST_INPUT_EX(FILENAME, CORE, BUF, TSIZE, TNUM, 0)
 
 		#define HOST_OUTPUT(CORE, FILENAME, BUF, TSIZE, TNUM)        \
-			{ COMM_CTYPE_HOST,                                   \
-			  { CORE },                                          \
-			  { (-1), (void*)offsetof(shm_t, BUF),               \
-			    &((comm_ctype_host_dsc_t) { (-1), FILENAME }) }, \
+			HOST_OUTPUT_EX(CORE, FILENAME, BUF, TSIZE, TNUM, 0)
+
+		/* same, with descriptor flags (COMM_HOST_*) */
+		#define HOST_INPUT_EX(FILENAME, CORE, BUF, TSIZE, TNUM, FLAGS) \
+			HOST_INPUT_CODEC(FILENAME, CORE, BUF, TSIZE, TNUM,     \
+				FLAGS, NULL)
+
+		#define HOST_OUTPUT_EX(CORE, FILENAME, BUF, TSIZE, TNUM, FLAGS) \
+			HOST_OUTPUT_CODEC(CORE, FILENAME, BUF, TSIZE, TNUM,     \
+				FLAGS, NULL)
+
+		/* same, file contents converted by a format adapter */
+		#define HOST_INPUT_CODEC(FILENAME, CORE, BUF, TSIZE, TNUM,    \
+			FLAGS, CODEC)                                         \
+			{ COMM_CTYPE_HOST,                                    \
+			  { (-1), { .off = offsetof(shm_t, BUF) },            \
+			    { .ptr = &((comm_ctype_host_dsc_t)                \
+			      { (-1), FILENAME, .flags = (FLAGS),             \
+			        .codec = (CODEC) }) } },                      \
+			  { CORE },                                           \
 			  TNUM, TSIZE, }
 
+		#define HOST_OUTPUT_CODEC(CORE, FILENAME, BUF, TSIZE, TNUM,   \
+			FLAGS, CODEC)                                         \
+			{ COMM_CTYPE_HOST,                                    \
+			  { CORE },                                           \
+			  { (-1), { .off = offsetof(shm_t, BUF) },            \
+			    { .ptr = &((comm_ctype_host_dsc_t)                \
+			      { (-1), FILENAME, .flags = (FLAGS),             \
+			        .codec = (CODEC) }) } },                      \
+			  TNUM, TSIZE, }
+
+		/* text files of floats (comm_host_codec_f32) */
+		#define HOST_INPUT_TEXT(FILENAME, CORE, BUF, TSIZE, TNUM)    \
+			HOST_INPUT_CODEC(FILENAME, CORE, BUF, TSIZE, TNUM,   \
+				0, &comm_host_codec_f32)
+		#define HOST_OUTPUT_TEXT(CORE, FILENAME, BUF, TSIZE, TNUM)   \
+			HOST_OUTPUT_CODEC(CORE, FILENAME, BUF, TSIZE, TNUM,  \
+				0, &comm_host_codec_f32)
+
+		/* input from a token log, see COMM_FLAG_RECORD; FLAGS may
+		   add COMM_HOST_TIMED */
+		#define HOST_INPUT_REPLAY(FILENAME, CORE, BUF, TSIZE, TNUM,  \
+			FLAGS)                                               \
+			HOST_INPUT_EX(FILENAME, CORE, BUF, TSIZE, TNUM,      \
+				COMM_HOST_REPLAY | (FLAGS))
+
+		/* memory-mapped input (regular files only) */
+		#define HOST_INPUT_MMAP(FILENAME, CORE, BUF, TSIZE, TNUM)    \
+			HOST_INPUT_EX(FILENAME, CORE, BUF, TSIZE, TNUM,      \
+				COMM_HOST_MMAP)
+		#define HOST_OUTPUT_MMAP(CORE, FILENAME, BUF, TSIZE, TNUM)   \
+			HOST_OUTPUT_EX(CORE, FILENAME, BUF, TSIZE, TNUM,     \
+				COMM_HOST_MMAP)
+
+		/* descriptor flags */
+		#define COMM_HOST_MMAP  0x1	/* map input or output file */
+		#define COMM_HOST_ASYNC 0x2	/* file I/O in background */
+		#define COMM_HOST_STREAM 0x4	/* non-blocking input, set for
+		                           	   pipes, FIFOs and terminals */
+		#define COMM_HOST_SPLICE 0x8	/* vmsplice() output, set for
+		                           	   pipes (pthreads) */
+		#define COMM_HOST_DIRECT 0x10	/* O_DIRECT file I/O, implies
+		                           	   COMM_HOST_ASYNC */
+		#define COMM_HOST_REPLAY 0x20	/* input is a token log */
+		#define COMM_HOST_TIMED  0x40	/* replay at recorded pace */
+
+		/* format adapter, converts file contents to tokens and back
+		   in the host service (hsrc/commlib-codec.c) */
+		typedef struct {
+			const char *name;
+			uint32_t   esize;	/* bytes per value, divides tsize */
+			uint32_t   width;	/* max. text bytes per value */
+
+			/* parse values from 'src' ('len' bytes) into 'dst'
+			   (room for 'max' bytes), '*out' gets bytes stored; a
+			   value running up to the end of 'src' is left for the
+			   next call unless 'last' is set. returns bytes of 'src'
+			   consumed, or -1 on malformed input */
+			long (*decode)(const char *src, size_t len, int last,
+				uint8_t *dst, size_t max, size_t *out);
+
+			/* format up to 'n' tokens of 'tsize' bytes from 'src'
+			   into 'dst', without exceeding 'max' bytes; '*out' gets
+			   bytes stored. returns tokens formatted */
+			int  (*encode)(const uint8_t *src, int n, uint32_t tsize,
+				char *dst, size_t max, size_t *out);
+		} comm_host_codec_t;
+
+		/* floats as text: separated by blanks, commas, semicolons or
+		   newlines on input, one token per line on output */
+		extern const comm_host_codec_t comm_host_codec_f32;
+
 		/* descriptor type */
 		typedef struct {
 			int      fd;	/* descriptor of file */
 			char     *file;	/* filename */
 			uint64_t count;	/* tokens transmitted */
+			uint8_t  *buf;	/* staging buffer (epiphany) */
+			uint32_t flags;	/* COMM_HOST_* */
+			uint8_t  *map;	/* mapped file (COMM_HOST_MMAP) */
+			uint64_t size;	/* size of mapping (file size, input) */
+			void     *priv;	/* host library state */
+			int      eof;	/* input exhausted, output closed */
+			uint8_t  *part;	/* partial token (COMM_HOST_STREAM) */
+			uint32_t plen;	/* bytes in partial token */
+			uint64_t held;	/* bytes spliced, not yet read */
+			uint8_t  *cbuf;	/* coalescing buffer (output files) */
+			uint32_t cfill;	/* bytes in coalescing buffer */
+			const comm_host_codec_t *codec;	/* NULL: raw tokens */
+			void     *text;	/* codec buffers (host library) */
+			void     *log;	/* replay state (COMM_HOST_REPLAY) */
 		} COMM_PACKED comm_ctype_host_dsc_t;
 	#endif
 #endif /* COMM_IS_HOST */
@@ -124,6 +329,29 @@ typedef struct {
 	int           comm_write(comm_handle_t, void *, size_t);
 	int           comm_level(comm_handle_t);
 	int           comm_space(comm_handle_t);
+	int           comm_closed(comm_handle_t);
+	void          comm_close_write(comm_handle_t);
+	void          comm_barrier(volatile comm_barrier_t *, int n);
+	void          comm_reset(void);
+	#ifdef COMM_PTHREAD
+	int           comm_init_cores(volatile comm_channel_t *, const int[],
+	                              int, void *, size_t);
+
+	/* library state of the core a thread serves, see comm_switch() */
+	typedef struct {
+		volatile comm_channel_t *channels;
+		unsigned core;
+		void     *heap_base;
+		size_t   heap_size;
+		size_t   heap_used;
+		void     (*yield)(void);	/* called by waiting ports */
+	} comm_state_t;
+	void          comm_switch(comm_state_t *save, const comm_state_t *load);
+	#endif
+
+	/* end of stream: comm_read(), comm_peek() and comm_level() of a
+	   channel that is closed by its writer and empty */
+	#define COMM_EOS (-1)
 
 	/* channel access functions */
 	typedef int (*readfn_t)(comm_handle_t, void*, size_t);
@@ -131,6 +359,7 @@ typedef struct {
 	typedef int (*writefn_t)(comm_handle_t, void*, size_t);
 	typedef int (*levelfn_t)(comm_handle_t);
 	typedef int (*spacefn_t)(comm_handle_t);
+	typedef void (*closefn_t)(comm_handle_t);
 
 	/* local base class */
 	typedef struct {
@@ -142,6 +371,10 @@ typedef struct {
 		writefn_t    writefn;
 		levelfn_t    levelfn;
 		spacefn_t    spacefn;
+		closefn_t    closefn;
+	#if (defined COMM_CFG_USE_RECORD && defined COMM_PTHREAD)
+		void         *rec;	/* token log of source port */
+	#endif
 	} COMM_ALIGN(8) comm_data_t;
 
 	#ifdef COMM_CFG_CTYPE_DEFAULT
@@ -152,6 +385,7 @@ typedef struct {
 			int rp;
 			int pp;
 			volatile int wp;
+			volatile int eos;	/* set by source after last wp */
 			char *buf;
 		} COMM_ALIGN(8) comm_cdefault_dst_t;
 		typedef struct comm_cdefault_src_s {	/* source end */
@@ -173,8 +407,78 @@ typedef struct {
 			volatile int32_t *rpp;
 			volatile int32_t *wpp;
 			uint8_t          *buf;
+			volatile comm_chost_shm_t *shm;
 		} COMM_ALIGN(8) comm_chost_core_t;
 	#endif /* COMM_CFG_CTYPE_HOST */
+
+	#ifdef COMM_CFG_CTYPE_SOCKET
+		/* SOCKET communication structure, either end */
+		typedef struct {
+			comm_data_t data;
+			int      fd;	/* connected socket */
+			int      lfd;	/* dst: listening socket, until accepted */
+			int      credit;	/* src: tokens the destination can take */
+			uint32_t clen;	/* src: bytes of partial credit message */
+			uint8_t  cmsg[4];
+			uint32_t owed;	/* dst: credits not sent yet */
+			uint32_t olen;	/* dst: bytes of credit message to send */
+			uint8_t  omsg[4];
+			int      rp;	/* dst: ring of tnum tokens */
+			int      pp;
+			int      wp;
+			uint32_t part;	/* dst: bytes received of token at wp */
+			int      eos;	/* dst: source shut down */
+			char     *buf;
+		} COMM_ALIGN(8) comm_csocket_t;
+	#endif /* COMM_CFG_CTYPE_SOCKET */
+
+	#ifdef COMM_PTHREAD
+		/* M:N actors (hsrc/commlib-sched.c): an actor fires when each
+		   input holds and each output has room for 'rate' tokens, so
+		   its comm_read()/comm_write() calls of up to 'rate' tokens
+		   per port don't block. Actors of all cores run on a pool of
+		   worker threads. An input closed by its writer counts as
+		   ready, so fire() gets the short read or COMM_EOS and can
+		   close its outputs. An actor that can't write because the
+		   actor draining that output is done, is done as well. */
+		#define COMM_ACTOR_PORTS 8
+
+		typedef struct {
+			int chan;	/* channel index */
+			int rate;	/* tokens per firing */
+		} comm_aport_t;
+
+		/* fire once, return 0 to stay, else the actor is done */
+		typedef int (*comm_firefn_t)(comm_handle_t in[],
+			comm_handle_t out[], void *arg);
+
+		typedef struct {
+			comm_firefn_t fire;
+			void          *arg;
+			int           core;	/* logical core of its ports */
+			int           nin;
+			int           nout;
+			comm_aport_t  in[COMM_ACTOR_PORTS];
+			comm_aport_t  out[COMM_ACTOR_PORTS];
+		} comm_actor_t;
+
+		/* initialize the actors' cores (one heap of 'heapsize'
+		   bytes) and run until all actors are done; 'workers' <= 0
+		   uses one thread per online CPU, the caller is one of them */
+		int comm_sched_run(comm_channel_t[], comm_actor_t[], int,
+			int workers, size_t heapsize);
+
+		/* fibers (hsrc/commlib-fiber.c): run fn(args[i]) for 'n'
+		   cores on the calling thread, 'stack' bytes each; a port
+		   that waits for tokens or room switches to the next fiber,
+		   so blocking kernels share threads unchanged */
+		typedef void (*comm_fiber_fn_t)(void *arg);
+
+		void  comm_fiber_run(comm_fiber_fn_t, void *args[], int n,
+			size_t stack);
+		void  comm_fiber_yield(void);
+		void* comm_fiber_arg(void);	/* of the running fiber */
+	#endif
 #endif /* COMM_IS_DEVICE */
 
 #endif /* _COMMLIB_H_ */
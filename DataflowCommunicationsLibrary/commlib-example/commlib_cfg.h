@@ -9,10 +9,63 @@
 /* channel types to support */
 #define COMM_CFG_CTYPE_DEFAULT
 #define COMM_CFG_CTYPE_HOST
+#define COMM_CFG_CTYPE_SOCKET	/* pthreads only */
 
 /* other configuration options */
 #undef  COMM_CFG_USE_IDLE
 #undef  COMM_CFG_USE_MALLOC
+#define COMM_CFG_USE_NUMA	/* pthreads: node-local heaps */
+#define COMM_CFG_USE_HUGEPAGES	/* pthreads: huge page backed memory */
+#define COMM_CFG_USE_RECORD	/* pthreads: token logs (COMM_FLAG_RECORD) */
+
+/* core processes (COMM_PROCESS): shared memory for core heaps, in bytes */
+#define COMM_CFG_PROC_ARENA (16*1024*1024)
+
+/* token logs: file name, from channel index */
+#define COMM_CFG_RECORD_FILE "channel-%02d.rec"
+
+/* socket channels: seconds to wait for the listening end */
+#define COMM_CFG_SOCKET_TIMEOUT 30
+
+/* core barrier: max. cores; polls before a wait yields the cpu, as
+   many again before it sleeps (pthreads, 0: spin only), and sleep per
+   poll (microseconds) */
+#define COMM_CFG_BARRIER_CORES 64
+#define COMM_CFG_BARRIER_SPIN  256
+#define COMM_CFG_BARRIER_SLEEP 20
+
+/* M:N actors: firings per turn of a worker, max. sleep of an idle
+   worker (microseconds) */
+#define COMM_CFG_SCHED_BURST     64
+#define COMM_CFG_SCHED_MAXWAIT 1000
+
+/* host service: sleep limits between passes (microseconds) */
+#define COMM_CFG_HOST_MINWAIT   100
+#define COMM_CFG_HOST_MAXWAIT 10000
+
+/* host service: publish rp/wp after this many bytes (at least 1 token) */
+#define COMM_CFG_HOST_CHUNK   65536
+
+/* host service: max. worker threads for host channels (0: main loop) */
+#define COMM_CFG_HOST_WORKERS     4
+
+/* host service: input files read ahead, in rings, by the I/O thread of
+   their channel; outputs write back on their own (0: on demand) */
+#define COMM_CFG_HOST_READAHEAD   4
+
+/* host service: buffer for small writes to output files, in bytes */
+#define COMM_CFG_HOST_COALESCE  (1024*1024)
+
+/* host service: mapped output files grow and start writeback in steps
+   of these many bytes */
+#define COMM_CFG_HOST_MAPGROW   (64*1024*1024)
+#define COMM_CFG_HOST_WRITEBACK ( 8*1024*1024)
+
+/* host service: buffer and block alignment for COMM_HOST_DIRECT */
+#define COMM_CFG_HOST_DIRECT_ALIGN 4096
+
+/* host service: text buffer of format adapters (HOST_*_CODEC), in bytes */
+#define COMM_CFG_HOST_TEXTBUF (256*1024)
 
 #endif /* _COMMLIB_CFG_H_ */
 
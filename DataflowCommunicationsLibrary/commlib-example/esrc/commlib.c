@@ -8,17 +8,25 @@
 /* changelog:
    v1: initial epiphany implementation
    v2: idle support; avoid modulo operations
-   v3: host channel support; pthreads support */
-#define VERSION "v3"
+   v3: host channel support; pthreads support
+   v4: fixed-width channel table, native 64-bit pthreads */
+#define VERSION "v4"
 
 #define TRAP_OOM     50		/* out of memory */
 #define TRAP_TABLE   51		/* invalid table entry or index */
 #define TRAP_INVALID 52		/* invalid access function */
+#define TRAP_RECORD  53		/* token log not writable */
+#define TRAP_SOCKET  54		/* socket channel failed */
 
 /* =====================================================================
    = API declaration                                                   =
    ===================================================================== */
 int comm_init(volatile comm_channel_t *ch, int id, void *hbase, size_t hsize);
+#ifdef COMM_PTHREAD
+int comm_init_cores(volatile comm_channel_t *ch, const int ids[], int n,
+	void *hbase, size_t hsize);
+void comm_switch(comm_state_t *save, const comm_state_t *load);
+#endif
 comm_handle_t comm_get_rhandle(int index);
 comm_handle_t comm_get_whandle(int index);
 int comm_read(comm_handle_t handle, void *buf, size_t count);
@@ -26,9 +34,13 @@ int comm_peek(comm_handle_t handle, void *buf, size_t count);
 int comm_write(comm_handle_t handle, void *buf, size_t count);
 int comm_level(comm_handle_t handle);
 int comm_space(comm_handle_t handle);
+int comm_closed(comm_handle_t handle);
+void comm_close_write(comm_handle_t handle);
+void comm_barrier(volatile comm_barrier_t *b, int n);
+void comm_reset(void);
 
 /* =====================================================================
-   = Hardware Abstraction: TRAP(num), GADDR(addr), CORELOCAL           =
+   = Hardware Abstraction: TRAP(num), GADDR(addr), CORELOCAL, YIELD()  =
    ===================================================================== */
 #if defined COMM_EPIPHANY
 	#include <e-lib.h>
@@ -36,6 +48,8 @@ int comm_space(comm_handle_t handle);
 	#define DO_TRAP(num) do { __asm__ volatile ("TRAP "#num); } while(1);
 	#define TRAP(num) DO_TRAP(num)
 
+	#define YIELD()
+
 	static inline void* GADDR(void* addr) {
 		unsigned row, col;
 		e_coords_from_coreid(e_get_coreid(), &row, &col);
@@ -58,11 +72,20 @@ int comm_space(comm_handle_t handle);
 
 	#define CORELOCAL __thread
 
+	/* fibers: a thread serving several cores switches to the next one
+	   while a core waits, see comm_switch() */
+	static __thread void (*yield_fn)(void);
+	#define YIELD() do { if(yield_fn) yield_fn(); } while(0)
+
 #else
 	#error unsupported architecture (define COMM_EPIPHANY or COMM_PTHREAD)
 
 #endif
 
+/* globals */
+static CORELOCAL volatile comm_channel_t *channels;
+static CORELOCAL unsigned core;
+
 /* =====================================================================
    = COMM_CFG_USE_IDLE: IDLEINIT(), IDLE() and WAKEUP(addr)            =
    ===================================================================== */
@@ -93,7 +116,7 @@ int comm_space(comm_handle_t handle);
 		/* pthreads IDLE support */
 		#warning pthreads idle support experimental
 		#define IDLEINIT()
-		#define IDLE() sched_yield()
+		#define IDLE() do { sched_yield(); YIELD(); } while(0)
 		#define WAKEUP(addr)
 
 	#else
@@ -102,13 +125,33 @@ int comm_space(comm_handle_t handle);
 	#endif
 
 #else
-	/* IDLE disabled */
+	/* IDLE disabled, still let other fibers run */
 	#define IDLEINIT()
-	#define IDLE()
+	#define IDLE() YIELD()
 	#define WAKEUP(addr)
 
 #endif /* COMM_CFG_USE_IDLE */
 
+/* =====================================================================
+   = Barrier: BARRIER_WAIT(polls)                                      =
+   ===================================================================== */
+#if (defined COMM_PTHREAD && COMM_CFG_BARRIER_SPIN > 0)
+	#include <sched.h>
+	#include <unistd.h>
+
+	/* let other fibers run; once spinning took too long, give up the
+	   cpu (more threads than cpus), then sleep */
+	#define BARRIER_WAIT(polls) do { \
+		YIELD(); \
+		if(++(polls) > 2 * COMM_CFG_BARRIER_SPIN) \
+			usleep(COMM_CFG_BARRIER_SLEEP); \
+		else if((polls) > COMM_CFG_BARRIER_SPIN) \
+			sched_yield(); \
+	} while(0)
+#else
+	#define BARRIER_WAIT(polls) do { (void)(polls); YIELD(); } while(0)
+#endif
+
 /* =====================================================================
    = COMM_CFG_USE_MALLOC: comm_malloc(size)                            =
    ===================================================================== */
@@ -120,30 +163,223 @@ int comm_space(comm_handle_t handle);
 	/* global variables */
 	static CORELOCAL void*  heap_base = NULL;
 	static CORELOCAL size_t heap_size = 0;
+	static CORELOCAL size_t heap_used = 0;
 
 	/* simple memory allocator, no free support;
 	   requires userspace heap */
 	static void *comm_malloc(size_t size)
 	{
-		static CORELOCAL int offset = 0;
-
-		if(size <= 0 || offset + size > heap_size)
+		if(size <= 0 || heap_used + size > heap_size)
 			return(NULL);
 
 		/* align to 8 bytes */
 		size_t tmp = size + 7;
 		while(tmp >= 8)
 			tmp -= 8;
-		size   += 7 - tmp;
-		offset += size;
+		size      += 7 - tmp;
+		heap_used += size;
 
-		return(heap_base + offset - size);
+		return(heap_base + heap_used - size);
 	}
 #endif
 
-/* globals */
-static CORELOCAL volatile comm_channel_t *channels;
-static CORELOCAL unsigned core;
+/* =====================================================================
+   = COMM_PROCESS, COMM_CFG_USE_NUMA: HEAPINIT(base, size)             =
+   ===================================================================== */
+#if (defined COMM_PROCESS && !defined COMM_CFG_USE_MALLOC)
+	/* core processes: heaps come from the arena behind shm_t, which all
+	   processes inherit at the same address, so ports and rings can be
+	   shared by pointer. Pages are first touched by the allocating
+	   core. Without an arena (threads only), use the caller's heap. */
+	static void *proc_heap(void *base, size_t size)
+	{
+		comm_arena_t *arena = comm_host_arena;
+		if(!arena)
+			return(GADDR(base));
+
+		uint64_t len = (size + 63) & ~(uint64_t)63;
+		uint64_t off = __sync_fetch_and_add(&arena->used, len);
+		if(off + len > arena->size) {	/* OOM */
+			TRAP(TRAP_OOM);
+		}
+
+		return(arena->mem + off);
+	}
+
+	#define HEAPINIT(base, size) proc_heap(base, size)
+
+#elif (defined COMM_CFG_USE_NUMA && defined COMM_PTHREAD && \
+     !defined COMM_CFG_USE_MALLOC)
+	#include <unistd.h>
+	#include <sys/mman.h>
+
+	#define HUGEPAGE_SIZE (2*1024*1024)
+
+	/* replace the caller's heap by a private arena; it is first touched
+	   by the calling thread, so ports and ring buffers allocated by this
+	   core end up on its NUMA node. Falls back to the caller's heap. */
+	static void *numa_heap(void *base, size_t size)
+	{
+		long   page  = sysconf(_SC_PAGESIZE);
+		size_t len   = (size + page - 1) & ~(page - 1);
+		void  *arena = MAP_FAILED;
+
+	#ifdef COMM_CFG_USE_HUGEPAGES
+		/* large heaps: try reserved huge pages, then THP */
+		if(size >= HUGEPAGE_SIZE) {
+			len   = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+			arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+				-1, 0);
+			if(arena == MAP_FAILED) {
+				arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if(arena != MAP_FAILED)
+					madvise(arena, len, MADV_HUGEPAGE);
+			}
+		}
+	#endif
+
+		if(arena == MAP_FAILED)
+			arena = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(arena == MAP_FAILED)
+			return(base);
+
+		memset(arena, 0, len);	/* first touch */
+		return(arena);
+	}
+
+	#define HEAPINIT(base, size) numa_heap(base, size)
+
+#else
+	#define HEAPINIT(base, size) GADDR(base)
+
+#endif /* COMM_CFG_USE_NUMA */
+
+/* =====================================================================
+   = COMM_CFG_USE_RECORD: RECOPEN(channel, index), RECORD(data, buf, n) =
+   =                      RECFLUSH(data)                               =
+   ===================================================================== */
+#if (defined COMM_CFG_USE_RECORD && defined COMM_PTHREAD)
+	#include <time.h>
+
+	typedef struct {
+		FILE     *file;
+		uint64_t index;		/* tokens logged */
+		int      timed;
+	} rec_t;
+
+	/* open logs by channel index; the ports go with the heap on the
+	   next comm_init(), the logs are closed here */
+	static rec_t          *rec_logs[COMM_NUM_CHANNELS];
+	static pthread_once_t rec_once = PTHREAD_ONCE_INIT;
+
+	/* returns non-zero if the log couldn't be written out */
+	static int rec_close(int index)
+	{
+		rec_t *rec = rec_logs[index];
+		if(!rec)
+			return(0);
+
+		int ret = fclose(rec->file);
+		rec_logs[index] = NULL;
+		free(rec);
+		return(ret);
+	}
+
+	/* no TRAP() here, exit() is running */
+	static void rec_exit(void)
+	{
+		for(int i = 0; i < COMM_NUM_CHANNELS; i++)
+			if(rec_close(i))
+				fprintf(stderr, "\nWARNING: token log of channel "
+					"%i incomplete\n", i);
+	}
+
+	static void rec_atexit(void)
+	{
+		atexit(rec_exit);
+	}
+
+	/* open token log for a local source port, if the table asks;
+	   replaces the log of an earlier comm_init() */
+	static void rec_open(volatile comm_channel_t *channel, int index)
+	{
+		comm_data_t *data = channel->src.dptr.ptr;
+
+		data->rec = NULL;
+		if(rec_close(index)) {
+			TRAP(TRAP_RECORD);
+		}
+		if(!(channel->flags & (COMM_FLAG_RECORD | COMM_FLAG_RECORD_TIME)))
+			return;
+
+		rec_t *rec = malloc(sizeof(rec_t));
+		if(!rec) {		/* OOM */
+			TRAP(TRAP_OOM);
+		}
+
+		char name[64];
+		snprintf(name, sizeof(name), COMM_CFG_RECORD_FILE, index);
+		rec->file  = fopen(name, "wb");
+		rec->index = 0;
+		rec->timed = !!(channel->flags & COMM_FLAG_RECORD_TIME);
+		if(!rec->file) {
+			TRAP(TRAP_RECORD);
+		}
+		setvbuf(rec->file, NULL, _IOFBF, 1024*1024);
+
+		comm_rec_hdr_t hdr = { COMM_REC_MAGIC, channel->tsize,
+			rec->timed ? COMM_FLAG_RECORD_TIME : 0 };
+		if(fwrite(&hdr, sizeof(hdr), 1, rec->file) != 1) {
+			TRAP(TRAP_RECORD);
+		}
+
+		data->rec       = rec;
+		rec_logs[index] = rec;
+		pthread_once(&rec_once, rec_atexit);
+	}
+
+	/* append one record: index, count, time, tokens;
+	   buffered, flushed at end of stream and by exit() */
+	static void rec_write(comm_data_t *data, void *buf, size_t count)
+	{
+		rec_t      *rec = data->rec;
+		comm_rec_t  hdr = { rec->index, count };
+		int         ok  = (fwrite(&hdr, sizeof(hdr), 1, rec->file) == 1);
+
+		if(rec->timed) {
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			uint64_t ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			ok &= (fwrite(&ns, sizeof(ns), 1, rec->file) == 1);
+		}
+		ok &= (fwrite(buf, data->tsize, count, rec->file) == count);
+		if(!ok) {
+			TRAP(TRAP_RECORD);
+		}
+		rec->index += count;
+	}
+
+	#define RECOPEN(channel, index) rec_open(channel, index)
+	#define RECORD(data, buf, count) do {              \
+			if((data)->rec && (count) > 0)     \
+				rec_write(data, buf, count); \
+		} while(0)
+	#define RECFLUSH(data) do {                                \
+			if((data)->rec &&                          \
+			   fflush(((rec_t*)(data)->rec)->file)) { \
+				TRAP(TRAP_RECORD);                 \
+			}                                          \
+		} while(0)
+
+#else
+	#define RECOPEN(channel, index) do { } while(0)
+	#define RECORD(data, buf, count) do { } while(0)
+	#define RECFLUSH(data) do { } while(0)
+
+#endif /* COMM_CFG_USE_RECORD */
 
 #ifdef COMM_CFG_CTYPE_DEFAULT
 /* =====================================================================
@@ -154,9 +390,13 @@ static int cdefault_read(comm_handle_t handle, void *buf, size_t count)
 	comm_cdefault_dst_t *port = handle;
 
 	for(size_t i = 0; i < count; i++) {
-		/* block until token ready */
-		while(port->rp == port->wp)
+		/* block until token ready or stream closed; eos is set
+		   after the last wp, so check wp once more */
+		while(port->rp == port->wp) {
+			if(port->eos && port->rp == port->wp)
+				return(i ? (int)i : COMM_EOS);
 			IDLE();
+		}
 
 		/* read one token */
 		memcpy(buf, &port->buf[port->rp * port->data.tsize],
@@ -185,8 +425,11 @@ static int cdefault_peek(comm_handle_t handle, void *buf, size_t count)
 
 	for(size_t i = 0; i < count; i++) {
 		/* return if no more tokens */
-		if(port->pp == port->wp)
+		if(port->pp == port->wp) {
+			if(!i && port->eos && port->rp == port->wp)
+				return(COMM_EOS);
 			return(i);
+		}
 
 		/* read one token */
 		memcpy(buf, &port->buf[port->pp * port->data.tsize],
@@ -244,6 +487,8 @@ static int cdefault_level(comm_handle_t handle)
 	while(tmp >= port->data.tnum)
 		tmp -= port->data.tnum;
 
+	if(!tmp && port->eos && port->rp == port->wp)
+		return(COMM_EOS);
 	return(tmp);
 }
 
@@ -259,6 +504,17 @@ static int cdefault_space(comm_handle_t handle)
 	return(tmp);
 }
 
+static void cdefault_close(comm_handle_t handle)
+{
+	comm_cdefault_src_t *port = handle;
+
+	/* mark end of stream behind the last token */
+	port->dst->eos = 1;
+
+	/* wake up remote */
+	WAKEUP(port->dst);
+}
+
 static void cdefault_create_src(volatile comm_channel_t *channel)
 {
 	/* allocate source port */
@@ -276,12 +532,21 @@ static void cdefault_create_src(volatile comm_channel_t *channel)
 	port->data.writefn = cdefault_write;
 	port->data.levelfn = NULL;
 	port->data.spacefn = cdefault_space;
-	port->rp = 0;
-	port->wp = 0;
+	port->data.closefn = cdefault_close;
+	port->rp  = 0;
+	port->wp  = 0;
+	port->buf = NULL;
+	if(channel->flags & COMM_FLAG_BUF_AT_SRC) {
+		port->buf = comm_malloc(port->data.tsize * port->data.tnum);
+		if(!port->buf) {	/* OOM */
+			TRAP(TRAP_OOM);
+		}
+	}
 
 	/* mark as ready and wait until it propagated */
-	channel->src.dptr = port;
-	while(channel->src.dptr != port);
+	channel->src.dptr.ptr = port;
+	while(channel->src.dptr.ptr != port)
+		YIELD();
 
 	return;
 }
@@ -303,49 +568,84 @@ static void cdefault_create_dst(volatile comm_channel_t *channel)
 	port->data.writefn = NULL;
 	port->data.levelfn = cdefault_level;
 	port->data.spacefn = NULL;
+	port->data.closefn = NULL;
 	port->rp  = 0;
 	port->pp  = 0;
 	port->wp  = 0;
-	port->buf = comm_malloc(port->data.tsize * port->data.tnum);
-	if(!port->buf) {	/* OOM */
-		TRAP(TRAP_OOM);
+	port->eos = 0;
+	port->buf = NULL;
+	if(!(channel->flags & COMM_FLAG_BUF_AT_SRC)) {
+		port->buf = comm_malloc(port->data.tsize * port->data.tnum);
+		if(!port->buf) {	/* OOM */
+			TRAP(TRAP_OOM);
+		}
 	}
 
 	/* mark as ready and wait until it propagated */
-	channel->dst.dptr = port;
-	while(channel->dst.dptr != port);
+	channel->dst.dptr.ptr = port;
+	while(channel->dst.dptr.ptr != port)
+		YIELD();
 
 	return;
 }
 
 static void cdefault_connect_src(volatile comm_channel_t *channel)
 {
-	comm_cdefault_src_t *port = channel->src.dptr;
+	comm_cdefault_src_t *port = channel->src.dptr.ptr;
 
 	/* wait for destination port */
-	while(!channel->dst.dptr);
+	while(!channel->dst.dptr.ptr)
+		YIELD();
 
 	/* grab remote address */
-	port->dst = channel->dst.dptr;
+	port->dst = channel->dst.dptr.ptr;
 
-	/* cache buffer address */
-	port->buf = port->dst->buf;
+	/* cache buffer address, unless we own it */
+	if(!port->buf)
+		port->buf = port->dst->buf;
 
 	return;
 }
 
 static void cdefault_connect_dst(volatile comm_channel_t *channel)
 {
-	comm_cdefault_dst_t *port = channel->dst.dptr;
+	comm_cdefault_dst_t *port = channel->dst.dptr.ptr;
 
 	/* wait for source port */
-	while(!channel->src.dptr);
+	while(!channel->src.dptr.ptr)
+		YIELD();
 
 	/* grab remote address */
-	port->src = channel->src.dptr;
+	port->src = channel->src.dptr.ptr;
+
+	/* cache buffer address, unless we own it */
+	if(!port->buf)
+		port->buf = port->src->buf;
 
 	return;
 }
+
+static void cdefault_reset_src(volatile comm_channel_t *channel)
+{
+	comm_cdefault_src_t *port = channel->src.dptr.ptr;
+
+	/* empty, writeable again */
+	port->rp = 0;
+	port->wp = 0;
+	port->data.writefn = cdefault_write;
+	port->data.closefn = cdefault_close;
+}
+
+static void cdefault_reset_dst(volatile comm_channel_t *channel)
+{
+	comm_cdefault_dst_t *port = channel->dst.dptr.ptr;
+
+	/* empty, not at end of stream */
+	port->rp  = 0;
+	port->pp  = 0;
+	port->wp  = 0;
+	port->eos = 0;
+}
 #endif /* COMM_CFG_CTYPE_DEFAULT */
 
 #ifdef COMM_CFG_CTYPE_HOST
@@ -354,11 +654,30 @@ static void cdefault_connect_dst(volatile comm_channel_t *channel)
    ===================================================================== */
 	#ifdef COMM_EPIPHANY
 		#define SHM_BASE 0x8f000000
+
+		/* host polls */
+		#define NOTIFY(port, avail)
 	#elif defined COMM_PTHREAD
 		/* dependent on host implementation */
 		#include "../shared.h"
-		extern shm_t shm;
-		const uint32_t SHM_BASE = (uint32_t)&shm;
+		#include <unistd.h>
+		#define SHM_BASE ((uintptr_t)shm_ptr)
+
+		/* wake host if it waits for 'avail' tokens to move */
+		#define NOTIFY(port, avail) do {                           \
+			__sync_synchronize();                              \
+			if((port)->shm->wait && (avail) >= (port)->shm->wait) \
+				chost_notify(port);                        \
+		} while(0);
+
+		static void chost_notify(comm_chost_core_t *port)
+		{
+			uint64_t one = 1;
+
+			port->shm->wait = 0;
+			if(write(port->shm->efd, &one, sizeof(one)) < 0)
+				;	/* host will time out */
+		}
 	#endif /* __epiphany__ */
 
 static int chost_read(comm_handle_t handle, void *buf, size_t count)
@@ -366,9 +685,12 @@ static int chost_read(comm_handle_t handle, void *buf, size_t count)
 	comm_chost_core_t *port = handle;
 
 	for(size_t i = 0; i < count; i++) {
-		/* block until token ready */
-		while(port->rp == *port->wpp)
-			;	/* do not idle! */
+		/* block until token ready or stream closed */
+		while(port->rp == *port->wpp) {
+			if(port->shm->eos && port->rp == *port->wpp)
+				return(i ? (int)i : COMM_EOS);
+			YIELD();	/* do not idle! */
+		}
 
 		/* read one token */
 		memcpy(buf, &port->buf[port->rp * port->data.tsize],
@@ -383,6 +705,8 @@ static int chost_read(comm_handle_t handle, void *buf, size_t count)
 		/* update read pointer */
 		 port->rp  = tmp;
 		*port->rpp = tmp;
+		NOTIFY(port, (tmp + port->data.tnum - 1 - *port->wpp) %
+			port->data.tnum);
 	}
 
 	return(count);
@@ -394,8 +718,11 @@ static int chost_peek(comm_handle_t handle, void *buf, size_t count)
 
 	for(size_t i = 0; i < count; i++) {
 		/* return if no more tokens */
-		if(port->pp == *port->wpp)
+		if(port->pp == *port->wpp) {
+			if(!i && port->shm->eos && port->rp == *port->wpp)
+				return(COMM_EOS);
 			return(i);
+		}
 
 		/* read one token */
 		memcpy(buf, &port->buf[port->pp * port->data.tsize],
@@ -426,7 +753,7 @@ static int chost_write(comm_handle_t handle, void *buf, size_t count)
 			tmp -= port->data.tnum;
 
 		while(*port->rpp == tmp)
-			;	/* do not idle! */
+			YIELD();	/* do not idle! */
 
 		/* write one token */
 		memcpy(&port->buf[port->wp * port->data.tsize], buf,
@@ -436,6 +763,8 @@ static int chost_write(comm_handle_t handle, void *buf, size_t count)
 		/* update write pointer */
 		 port->wp  = tmp;
 		*port->wpp = tmp;
+		NOTIFY(port, (tmp + port->data.tnum - *port->rpp) %
+			port->data.tnum);
 	}
 
 	return(count);
@@ -450,6 +779,8 @@ static int chost_level(comm_handle_t handle)
 	while(tmp >= port->data.tnum)
 		tmp -= port->data.tnum;
 
+	if(!tmp && port->shm->eos && port->rp == *port->wpp)
+		return(COMM_EOS);
 	return(tmp);
 }
 
@@ -465,6 +796,15 @@ static int chost_space(comm_handle_t handle)
 	return(tmp);
 }
 
+static void chost_close(comm_handle_t handle)
+{
+	comm_chost_core_t *port = handle;
+
+	/* mark end of stream behind the last token, wake host */
+	port->shm->eos = 1;
+	NOTIFY(port, port->data.tnum);
+}
+
 static void chost_create(volatile comm_channel_t *channel, int dir)
 {
 	/* allocate core data structure */
@@ -489,9 +829,10 @@ static void chost_create(volatile comm_channel_t *channel, int dir)
 		port->data.writefn = chost_write;
 		port->data.levelfn = NULL;
 		port->data.spacefn = chost_space;
+		port->data.closefn = chost_close;
 
 		/* pointer to shm structure */
-		shm = (void*)(SHM_BASE + (size_t)channel->dst.dptr);
+		shm = (void*)(SHM_BASE + (uintptr_t)channel->dst.dptr.off);
 	} else {
 		/* trap if source is not host */
 		if(channel->src.core != -1)
@@ -503,9 +844,10 @@ static void chost_create(volatile comm_channel_t *channel, int dir)
 		port->data.writefn = NULL;
 		port->data.levelfn = chost_level;
 		port->data.spacefn = NULL;
+		port->data.closefn = NULL;
 
 		/* pointer to shm structure */
-		shm = (void*)(SHM_BASE + (size_t)channel->src.dptr);
+		shm = (void*)(SHM_BASE + (uintptr_t)channel->src.dptr.off);
 	}
 
 	/* trap on invalid pointer in table */
@@ -518,16 +860,19 @@ static void chost_create(volatile comm_channel_t *channel, int dir)
 	port->rpp = &shm->rp;
 	port->wpp = &shm->wp;
 	port->buf = shm->buf;
+	port->shm = shm;
 
 	/* mark as ready and wait until it propagated */
 	if(dir) {
 		/* source end */
-		channel->src.dptr = port;
-		while(channel->src.dptr != port);
+		channel->src.dptr.ptr = port;
+		while(channel->src.dptr.ptr != port)
+			YIELD();
 	} else {
 		/* destination end */
-		channel->dst.dptr = port;
-		while(channel->dst.dptr != port);
+		channel->dst.dptr.ptr = port;
+		while(channel->dst.dptr.ptr != port)
+			YIELD();
 	}
 
 	return;
@@ -552,30 +897,602 @@ static void chost_connect_dst(volatile comm_channel_t *channel)
 {
 	return;		/* nothing to do */
 }
+
+/* local pointers only, the host empties the ring (comm_host_close()) */
+static void chost_reset(volatile comm_channel_t *channel, int dir)
+{
+	comm_chost_core_t *port = dir ?
+		channel->src.dptr.ptr : channel->dst.dptr.ptr;
+
+	port->rp = 0;
+	port->pp = 0;
+	port->wp = 0;
+	if(dir) {
+		port->data.writefn = chost_write;
+		port->data.closefn = chost_close;
+	}
+}
 #endif /* COMM_CFG_CTYPE_HOST */
 
+#ifdef COMM_CFG_CTYPE_SOCKET
 /* =====================================================================
-   = API implementation                                                =
+   = SOCKET channel type helper functions                              =
    ===================================================================== */
-/* initializes communication structures,
-   blocks until remotes ready, TRAPs on error */
-int comm_init(volatile comm_channel_t *ch, int id, void *hbase, size_t hsize)
+/* flow control: the source starts with 'tnum' credits and spends one
+   per token, the destination returns credits as a uint32_t in network
+   byte order for the tokens taken by each comm_read(); a source with
+   credits left writes straight from the caller's buffer, as many tokens
+   per send() as it may. the destination never blocks on returning
+   credits, a source that runs out of them reads them all at once */
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* report errno, if any, and stop */
+#define SOCK_TRAP(what) do { \
+		fprintf(stderr, "\nsocket: %s%s%s\n", what, \
+			errno ? ": " : "", errno ? strerror(errno) : ""); \
+		TRAP(TRAP_SOCKET); \
+	} while(0)
+
+/* send or receive exactly 'len' bytes */
+static void csocket_full(int fd, void *buf, size_t len, int wr)
 {
-	/* store library information globally */
-	channels  = ch;
-	core      = id;
-#ifndef COMM_CFG_USE_MALLOC
-	heap_base = GADDR(hbase);
-	heap_size = hsize;
-#endif
+	while(len) {
+		ssize_t ret = wr ? send(fd, buf, len, MSG_NOSIGNAL) :
+			recv(fd, buf, len, 0);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret == 0)
+			errno = 0;
+		if(ret <= 0)
+			SOCK_TRAP(ret ? "transfer failed" : "peer closed");
+
+		buf  = (char*)buf + ret;
+		len -= ret;
+	}
+}
 
-	/* initialize IDLE framework */
-	IDLEINIT();
+/* collect credits, waits for one if 'block' is set;
+   returns -1 if the peer is gone */
+static int csocket_credit(comm_csocket_t *port, int block)
+{
+	uint8_t tmp[256];
+
+	do {
+		memcpy(tmp, port->cmsg, port->clen);
+		ssize_t ret = recv(port->fd, tmp + port->clen,
+			sizeof(tmp) - port->clen, block ? 0 : MSG_DONTWAIT);
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return(0);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return(-1);
+
+		size_t len = port->clen + ret, pos;
+		for(pos = 0; pos + 4 <= len; pos += 4) {
+			uint32_t n;
+			memcpy(&n, tmp + pos, 4);
+			port->credit += ntohl(n);
+		}
+		port->clen = len - pos;
+		memcpy(port->cmsg, tmp + pos, port->clen);
+	} while(block && !port->credit);
+
+	return(0);
+}
+
+/* send owed credits without blocking, the rest goes later;
+   a source that is gone needs none */
+static void csocket_return(comm_csocket_t *port)
+{
+	for(;;) {
+		/* next message */
+		if(!port->olen) {
+			if(!port->owed)
+				return;
+			uint32_t n = htonl(port->owed);
+			memcpy(port->omsg, &n, 4);
+			port->olen = 4;
+			port->owed = 0;
+		}
+
+		ssize_t ret = send(port->fd, port->omsg + 4 - port->olen,
+			port->olen, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(ret < 0 && (errno == EPIPE || errno == ECONNRESET)) {
+			port->olen = 0;
+			port->owed = 0;
+			return;
+		}
+		if(ret < 0)
+			SOCK_TRAP("transfer failed");
+
+		port->olen -= ret;
+	}
+}
+
+/* source ports to linger on at exit */
+static comm_csocket_t *csocket_srcs[COMM_NUM_CHANNELS];
+static int             csocket_nsrcs;
+static pthread_once_t  csocket_once = PTHREAD_ONCE_INIT;
+
+/* at exit, wait until the destination has taken every token: closing
+   a socket with unread credits resets the connection, which may drop
+   tokens still in flight. Gives up once no credit came for
+   COMM_CFG_SOCKET_TIMEOUT seconds */
+static void csocket_exit(void)
+{
+	struct timeval tv = { COMM_CFG_SOCKET_TIMEOUT, 0 };
+
+	for(int i = 0; i < csocket_nsrcs; i++) {
+		comm_csocket_t *port = csocket_srcs[i];
+		if(!port)
+			continue;
+
+		shutdown(port->fd, SHUT_WR);
+		setsockopt(port->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		while(port->credit < port->data.tnum - 1) {
+			int      credit = port->credit;
+			uint32_t clen   = port->clen;
+			if(csocket_credit(port, 1) ||
+			   (port->credit == credit && port->clen == clen))
+				break;	/* peer gone or timed out */
+		}
+	}
+}
+
+static void csocket_atexit(void)
+{
+	atexit(csocket_exit);
+}
+
+/* receive into free ring space, waits for data if 'block' is set;
+   while waiting, owed credits go out as soon as they fit. The source
+   shutting down ends the stream */
+static void csocket_pump(comm_csocket_t *port, int block)
+{
+	size_t tsize = port->data.tsize;
+	size_t ring  = tsize * port->data.tnum;
+
+	if(port->eos)
+		return;
+
+	/* free bytes: capacity minus complete tokens and partial token */
+	int level = port->data.tnum + port->wp - port->rp;
+	while(level >= port->data.tnum)
+		level -= port->data.tnum;
+	size_t room = (port->data.tnum - 1 - level) * tsize - port->part;
+	if(!room)
+		return;
+
+	size_t wpos = port->wp * tsize + port->part;
+	struct iovec iov[2] = {
+		{ port->buf + wpos, ring - wpos },
+		{ port->buf,        0           },
+	};
+	if(iov[0].iov_len >= room) {
+		iov[0].iov_len = room;
+	} else {
+		iov[1].iov_len = room - iov[0].iov_len;
+	}
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+	ssize_t ret;
+	for(;;) {
+		int flags = MSG_DONTWAIT;
+		if(block) {
+			csocket_return(port);
+			if(port->owed || port->olen) {
+				/* source may wait for credits */
+				struct pollfd pfd = { port->fd, POLLIN | POLLOUT };
+				if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+					SOCK_TRAP("poll");
+				if(!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+					continue;
+			} else {
+				flags = 0;
+			}
+		}
+
+		ret = recvmsg(port->fd, &msg, flags);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if(block)
+				continue;
+			return;
+		}
+		break;
+	}
+	if(ret == 0) {
+		/* a partial token can't be completed anymore */
+		port->eos  = 1;
+		port->part = 0;
+		return;
+	}
+	if(ret < 0)
+		SOCK_TRAP("transfer failed");
+
+	/* advance write pointer over complete tokens */
+	port->part += ret;
+	while(port->part >= tsize) {
+		port->part -= tsize;
+		int tmp = port->wp + 1;
+		while(tmp >= port->data.tnum)
+			tmp -= port->data.tnum;
+		port->wp = tmp;
+	}
+}
+
+static int csocket_read(comm_handle_t handle, void *buf, size_t count)
+{
+	comm_csocket_t *port = handle;
+
+	/* take what's there in one go */
+	csocket_pump(port, 0);
+
+	for(size_t i = 0; i < count; i++) {
+		/* block until token ready or stream closed */
+		while(port->rp == port->wp) {
+			if(port->eos) {
+				csocket_return(port);
+				port->pp = port->rp;
+				return(i ? (int)i : COMM_EOS);
+			}
+			csocket_pump(port, 1);
+		}
+
+		/* read one token */
+		memcpy(buf, &port->buf[port->rp * port->data.tsize],
+			port->data.tsize);
+		buf = (char*)buf + port->data.tsize;
+
+		/* update read pointer */
+		int tmp = (port->rp + 1);
+		while(tmp >= port->data.tnum)
+			tmp -= port->data.tnum;
+		port->rp = tmp;
+		port->owed++;
+	}
+
+	/* return credits */
+	csocket_return(port);
+	port->pp = port->rp;
+
+	return(count);
+}
+
+static int csocket_peek(comm_handle_t handle, void *buf, size_t count)
+{
+	comm_csocket_t *port = handle;
+
+	csocket_pump(port, 0);
+
+	for(size_t i = 0; i < count; i++) {
+		/* return if no more tokens */
+		if(port->pp == port->wp) {
+			port->pp = port->rp;
+			return((!i && port->eos) ? COMM_EOS : (int)i);
+		}
+
+		/* read one token */
+		memcpy(buf, &port->buf[port->pp * port->data.tsize],
+			port->data.tsize);
+		buf = (char*)buf + port->data.tsize;
+
+		/* update peek pointer */
+		int tmp = port->pp + 1;
+		while(tmp >= port->data.tnum)
+			tmp -= port->data.tnum;
+		port->pp = tmp;
+	}
+
+	/* reset peek pointer */
+	port->pp = port->rp;
 
+	return(count);
+}
+
+static int csocket_write(comm_handle_t handle, void *buf, size_t count)
+{
+	comm_csocket_t *port = handle;
+	size_t left = count;
+
+	while(left) {
+		/* wait for credits */
+		if(!port->credit && (csocket_credit(port, 0) ||
+		   (!port->credit && csocket_credit(port, 1))))
+			SOCK_TRAP("credits lost");
+
+		/* send as many tokens as the destination can take */
+		size_t n = (left < (size_t)port->credit) ? left : port->credit;
+		csocket_full(port->fd, buf, n * port->data.tsize, 1);
+		buf = (char*)buf + n * port->data.tsize;
+
+		port->credit -= n;
+		left         -= n;
+	}
+
+	return(count);
+}
+
+static int csocket_level(comm_handle_t handle)
+{
+	comm_csocket_t *port = handle;
+
+	csocket_pump(port, 0);
+
+	/* calculate level */
+	int tmp = port->data.tnum + port->wp - port->rp;
+	while(tmp >= port->data.tnum)
+		tmp -= port->data.tnum;
+
+	if(!tmp && port->eos)
+		return(COMM_EOS);
+	return(tmp);
+}
+
+static int csocket_space(comm_handle_t handle)
+{
+	comm_csocket_t *port = handle;
+
+	if(csocket_credit(port, 0))
+		SOCK_TRAP("credits lost");
+
+	return(port->credit);
+}
+
+static void csocket_close(comm_handle_t handle)
+{
+	comm_csocket_t *port = handle;
+
+	/* destination reads eof behind the last token */
+	if(shutdown(port->fd, SHUT_WR))
+		SOCK_TRAP("shutdown");
+}
+
+/* resolve "unix:PATH" or "tcp:HOST:PORT" */
+static int csocket_addr(const char *addr, struct sockaddr_storage *sa,
+	socklen_t *len)
+{
+	memset(sa, 0, sizeof(*sa));
+
+	if(!strncmp(addr, "unix:", 5)) {
+		struct sockaddr_un *un = (struct sockaddr_un*)sa;
+		if(strlen(addr + 5) >= sizeof(un->sun_path)) {
+			TRAP(TRAP_TABLE);
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, addr + 5);
+		*len = sizeof(*un);
+		return(AF_UNIX);
+	}
+
+	const char *port = strrchr(addr, ':');
+	if(strncmp(addr, "tcp:", 4) || port <= addr + 3) {
+		TRAP(TRAP_TABLE);
+	}
+
+	char host[256];
+	size_t hlen = port - (addr + 4);
+	if(hlen >= sizeof(host)) {
+		TRAP(TRAP_TABLE);
+	}
+	memcpy(host, addr + 4, hlen);
+	host[hlen] = '\0';
+
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res;
+	if(getaddrinfo(hlen ? host : NULL, port + 1, &hints, &res)) {
+		TRAP(TRAP_TABLE);
+	}
+	memcpy(sa, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return(sa->ss_family);
+}
+
+/* socket options for a connected end */
+static void csocket_setup(comm_csocket_t *port)
+{
+	int one = 1, size = 2 * port->data.tnum * port->data.tsize;
+	static const int opt[2] = { SO_SNDBUF, SO_RCVBUF };
+
+	/* optional, errors are fine (not TCP, limits) */
+	setsockopt(port->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	/* let the socket hold a ring, never shrink it */
+	for(int i = 0; i < 2; i++) {
+		int cur;
+		socklen_t len = sizeof(cur);
+		if(!getsockopt(port->fd, SOL_SOCKET, opt[i], &cur, &len) &&
+		   cur < size)
+			setsockopt(port->fd, SOL_SOCKET, opt[i], &size,
+				sizeof(size));
+	}
+}
+
+static comm_csocket_t* csocket_create(volatile comm_channel_t *channel)
+{
+	/* allocate port */
+	comm_csocket_t *port = comm_malloc(sizeof(comm_csocket_t));
+	if(!port) {		/* OOM */
+		TRAP(TRAP_OOM);
+	}
+
+	/* initialize it */
+	port->data.type    = COMM_CTYPE_SOCKET;
+	port->data.tsize   = channel->tsize;
+	port->data.tnum    = channel->tnum + 1;
+	port->data.readfn  = NULL;
+	port->data.peekfn  = NULL;
+	port->data.writefn = NULL;
+	port->data.levelfn = NULL;
+	port->data.spacefn = NULL;
+	port->data.closefn = NULL;
+	port->fd     = -1;
+	port->lfd    = -1;
+	port->credit = 0;
+	port->clen   = 0;
+	port->owed   = 0;
+	port->olen   = 0;
+	port->rp     = 0;
+	port->pp     = 0;
+	port->wp     = 0;
+	port->part   = 0;
+	port->eos    = 0;
+	port->buf    = NULL;
+
+	return(port);
+}
+
+static void csocket_create_src(volatile comm_channel_t *channel)
+{
+	comm_csocket_t *port = csocket_create(channel);
+	port->data.writefn = csocket_write;
+	port->data.spacefn = csocket_space;
+	port->data.closefn = csocket_close;
+	port->credit       = channel->tnum;
+
+	/* mark as ready and wait until it propagated */
+	channel->src.dptr.ptr = port;
+	while(channel->src.dptr.ptr != port)
+		YIELD();
+
+	return;
+}
+
+static void csocket_create_dst(volatile comm_channel_t *channel)
+{
+	comm_csocket_t *port = csocket_create(channel);
+	port->data.readfn  = csocket_read;
+	port->data.peekfn  = csocket_peek;
+	port->data.levelfn = csocket_level;
+	port->buf = comm_malloc(port->data.tsize * port->data.tnum);
+	if(!port->buf) {	/* OOM */
+		TRAP(TRAP_OOM);
+	}
+
+	/* listen before anybody connects */
+	comm_ctype_socket_dsc_t *desc = channel->dst.hptr.ptr;
+	if(desc->fd != -1) {
+		port->fd = desc->fd;
+	} else if(!strcmp(desc->addr, "pair")) {
+		int sv[2];
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+			SOCK_TRAP("socketpair");
+		port->fd = sv[0];
+		((volatile comm_ctype_socket_dsc_t*)
+			channel->src.hptr.ptr)->fd = sv[1];
+	} else {
+		struct sockaddr_storage sa;
+		socklen_t len;
+		int family = csocket_addr(desc->addr, &sa, &len), one = 1;
+
+		port->lfd = socket(family, SOCK_STREAM, 0);
+		if(port->lfd < 0)
+			SOCK_TRAP(desc->addr);
+		struct stat st;
+		if(family == AF_UNIX) {
+			/* replace a stale socket, nothing else */
+			if(!stat(desc->addr + 5, &st) && S_ISSOCK(st.st_mode))
+				unlink(desc->addr + 5);
+		} else
+			setsockopt(port->lfd, SOL_SOCKET, SO_REUSEADDR,
+				&one, sizeof(one));
+		if(bind(port->lfd, (struct sockaddr*)&sa, len) ||
+		   listen(port->lfd, 1))
+			SOCK_TRAP(desc->addr);
+	}
+
+	/* mark as ready and wait until it propagated */
+	channel->dst.dptr.ptr = port;
+	while(channel->dst.dptr.ptr != port)
+		YIELD();
+
+	return;
+}
+
+static void csocket_connect_src(volatile comm_channel_t *channel)
+{
+	comm_csocket_t *port = channel->src.dptr.ptr;
+	volatile comm_ctype_socket_dsc_t *desc = channel->src.hptr.ptr;
+
+	if(!strcmp(desc->addr, "pair")) {
+		/* wait for destination port */
+		while(desc->fd == -1)
+			YIELD();
+		port->fd = desc->fd;
+	} else if(desc->fd != -1) {
+		port->fd = desc->fd;
+	} else {
+		struct sockaddr_storage sa;
+		socklen_t len;
+		int family = csocket_addr(desc->addr, &sa, &len);
+
+		/* retry until the destination listens */
+		for(int i = 0; ; i++) {
+			port->fd = socket(family, SOCK_STREAM, 0);
+			if(port->fd < 0)
+				SOCK_TRAP(desc->addr);
+			if(!connect(port->fd, (struct sockaddr*)&sa, len))
+				break;
+			if(i >= COMM_CFG_SOCKET_TIMEOUT * 100)
+				SOCK_TRAP(desc->addr);
+			close(port->fd);
+			usleep(10000);
+		}
+
+		/* linger at exit, see csocket_exit() */
+		pthread_once(&csocket_once, csocket_atexit);
+		csocket_srcs[__sync_fetch_and_add(&csocket_nsrcs, 1)] = port;
+	}
+	csocket_setup(port);
+
+	return;
+}
+
+static void csocket_connect_dst(volatile comm_channel_t *channel)
+{
+	comm_csocket_t *port = channel->dst.dptr.ptr;
+
+	if(port->lfd != -1) {
+		port->fd = accept(port->lfd, NULL, NULL);
+		if(port->fd < 0)
+			SOCK_TRAP("accept");
+		close(port->lfd);
+		port->lfd = -1;
+	}
+	csocket_setup(port);
+
+	return;
+}
+#endif /* COMM_CFG_CTYPE_SOCKET */
+
+/* =====================================================================
+   = API implementation                                                =
+   ===================================================================== */
+/* create ports and buffers of core 'id' */
+static void comm_create(int id)
+{
 	/* create local data structures and buffers */
 	for(size_t i = 0; i < COMM_NUM_CHANNELS; i++) {
 		/* channel sources */
-		if(channels[i].src.core == core) {
+		if(channels[i].src.core == id) {
 			switch(channels[i].type) {
 			case COMM_CTYPE_INVALID:
 				break;
@@ -589,13 +1506,22 @@ int comm_init(volatile comm_channel_t *ch, int id, void *hbase, size_t hsize)
 				chost_create_src(&channels[i]);
 				break;
 #endif /* COMM_CFG_CTYPE_HOST */
+#ifdef COMM_CFG_CTYPE_SOCKET
+			case COMM_CTYPE_SOCKET:
+				csocket_create_src(&channels[i]);
+				break;
+#endif /* COMM_CFG_CTYPE_SOCKET */
 			default:
 				TRAP(TRAP_TABLE);
 			}
+
+			/* token log, if requested */
+			if(channels[i].type != COMM_CTYPE_INVALID)
+				RECOPEN(&channels[i], i);
 		}
 
 		/* channel destinations */
-		if(channels[i].dst.core == core) {
+		if(channels[i].dst.core == id) {
 			switch(channels[i].type) {
 			case COMM_CTYPE_INVALID:
 				break;
@@ -609,16 +1535,25 @@ int comm_init(volatile comm_channel_t *ch, int id, void *hbase, size_t hsize)
 				chost_create_dst(&channels[i]);
 				break;
 #endif /* COMM_CFG_CTYPE_HOST */
+#ifdef COMM_CFG_CTYPE_SOCKET
+			case COMM_CTYPE_SOCKET:
+				csocket_create_dst(&channels[i]);
+				break;
+#endif /* COMM_CFG_CTYPE_SOCKET */
 			default:
 				TRAP(TRAP_TABLE);
 			}
 		}
 	}
+}
 
+/* connect ports of core 'id' to their remotes, blocks until ready */
+static void comm_connect(int id)
+{
 	/* connect local and remote structures */
 	for(size_t i = 0; i < COMM_NUM_CHANNELS; i++) {
 		/* channel sources */
-		if(channels[i].src.core == core) {
+		if(channels[i].src.core == id) {
 			switch(channels[i].type) {
 			case COMM_CTYPE_INVALID:
 				break;
@@ -632,13 +1567,18 @@ int comm_init(volatile comm_channel_t *ch, int id, void *hbase, size_t hsize)
 				chost_connect_src(&channels[i]);
 				break;
 #endif /* COMM_CFG_CTYPE_HOST */
+#ifdef COMM_CFG_CTYPE_SOCKET
+			case COMM_CTYPE_SOCKET:
+				csocket_connect_src(&channels[i]);
+				break;
+#endif /* COMM_CFG_CTYPE_SOCKET */
 			default:
 				TRAP(TRAP_TABLE);
 			}
 		}
 
 		/* channel destinations */
-		if(channels[i].dst.core == core) {
+		if(channels[i].dst.core == id) {
 			switch(channels[i].type) {
 			case COMM_CTYPE_INVALID:
 				break;
@@ -652,15 +1592,92 @@ int comm_init(volatile comm_channel_t *ch, int id, void *hbase, size_t hsize)
 				chost_connect_dst(&channels[i]);
 				break;
 #endif /* COMM_CFG_CTYPE_HOST */
+#ifdef COMM_CFG_CTYPE_SOCKET
+			case COMM_CTYPE_SOCKET:
+				csocket_connect_dst(&channels[i]);
+				break;
+#endif /* COMM_CFG_CTYPE_SOCKET */
 			default:
 				TRAP(TRAP_TABLE);
 			}
 		}
 	}
+}
+
+/* initializes communication structures,
+   blocks until remotes ready, TRAPs on error */
+int comm_init(volatile comm_channel_t *ch, int id, void *hbase, size_t hsize)
+{
+	/* store library information globally */
+	channels  = ch;
+	core      = id;
+#ifndef COMM_CFG_USE_MALLOC
+	heap_base = HEAPINIT(hbase, hsize);
+	heap_size = hsize;
+	heap_used = 0;
+#endif
+
+	/* initialize IDLE framework */
+	IDLEINIT();
+
+	comm_create(id);
+	comm_connect(id);
 
 	return(1);
 }
 
+#ifdef COMM_PTHREAD
+/* same for several cores served by the calling thread, which share one
+   heap; all ports are created before any is connected, so channels
+   between these cores can't block. Handles come from the table
+   (src/dst.dptr), comm_get_*handle() only knows the first core */
+int comm_init_cores(volatile comm_channel_t *ch, const int ids[], int n,
+	void *hbase, size_t hsize)
+{
+	/* store library information globally */
+	channels  = ch;
+	core      = ids[0];
+#ifndef COMM_CFG_USE_MALLOC
+	heap_base = HEAPINIT(hbase, hsize);
+	heap_size = hsize;
+	heap_used = 0;
+#endif
+
+	/* initialize IDLE framework */
+	IDLEINIT();
+
+	for(int i = 0; i < n; i++)
+		comm_create(ids[i]);
+	for(int i = 0; i < n; i++)
+		comm_connect(ids[i]);
+
+	return(1);
+}
+
+/* save the calling thread's library state to 'save' and continue with
+   'load', for threads that serve several cores in turn (fibers) */
+void comm_switch(comm_state_t *save, const comm_state_t *load)
+{
+	save->channels  = channels;
+	save->core      = core;
+	save->yield     = yield_fn;
+#ifndef COMM_CFG_USE_MALLOC
+	save->heap_base = heap_base;
+	save->heap_size = heap_size;
+	save->heap_used = heap_used;
+#endif
+
+	channels  = load->channels;
+	core      = load->core;
+	yield_fn  = load->yield;
+#ifndef COMM_CFG_USE_MALLOC
+	heap_base = load->heap_base;
+	heap_size = load->heap_size;
+	heap_used = load->heap_used;
+#endif
+}
+#endif /* COMM_PTHREAD */
+
 /* return read handle from global table index */
 comm_handle_t comm_get_rhandle(int index)
 {
@@ -670,10 +1687,10 @@ comm_handle_t comm_get_rhandle(int index)
 	if(channels[index].dst.core != core)
 		TRAP(TRAP_TABLE);
 
-	if(!channels[index].dst.dptr)
+	if(!channels[index].dst.dptr.ptr)
 		TRAP(TRAP_TABLE);
 
-	return(channels[index].dst.dptr);
+	return(channels[index].dst.dptr.ptr);
 }
 
 /* return write handle from global table index */
@@ -685,13 +1702,14 @@ comm_handle_t comm_get_whandle(int index)
 	if(channels[index].src.core != core)
 		TRAP(TRAP_TABLE);
 
-	if(!channels[index].src.dptr)
+	if(!channels[index].src.dptr.ptr)
 		TRAP(TRAP_TABLE);
 
-	return(channels[index].src.dptr);
+	return(channels[index].src.dptr.ptr);
 }
 
-/* reads 'count' tokens into 'buf', may block */
+/* reads 'count' tokens into 'buf', may block; fewer if the writer
+   closed the channel, COMM_EOS if it is closed and empty */
 int comm_read(comm_handle_t handle, void *buf, size_t count)
 {
 	comm_data_t *data = handle;
@@ -701,7 +1719,7 @@ int comm_read(comm_handle_t handle, void *buf, size_t count)
 	return(data->readfn(handle, buf, count));
 }
 
-/* copy up to 'count' tokens into 'buf' */
+/* copy up to 'count' tokens into 'buf', COMM_EOS if closed and empty */
 int comm_peek(comm_handle_t handle, void *buf, size_t count)
 {
 	comm_data_t *data = handle;
@@ -718,10 +1736,13 @@ int comm_write(comm_handle_t handle, void *buf, size_t count)
 	if(!data || !data->writefn)
 		TRAP(TRAP_INVALID);
 
-	return(data->writefn(handle, buf, count));
+	int ret = data->writefn(handle, buf, count);
+	RECORD(data, buf, ret);
+	return(ret);
 }
 
-/* returns number of tokens readable without blocking */
+/* returns number of tokens readable without blocking,
+   COMM_EOS if closed and empty */
 int comm_level(comm_handle_t handle)
 {
 	comm_data_t *data = handle;
@@ -741,3 +1762,121 @@ int comm_space(comm_handle_t handle)
 	return(data->spacefn(handle));
 }
 
+/* returns non-zero once the writer closed the channel, tokens may
+   still be left to read */
+int comm_closed(comm_handle_t handle)
+{
+	comm_data_t *data = handle;
+	if(!data || !data->levelfn)
+		TRAP(TRAP_INVALID);
+
+	switch(data->type) {
+#ifdef COMM_CFG_CTYPE_DEFAULT
+	case COMM_CTYPE_DEFAULT:
+		return(((comm_cdefault_dst_t*)handle)->eos);
+#endif /* COMM_CFG_CTYPE_DEFAULT */
+#ifdef COMM_CFG_CTYPE_HOST
+	case COMM_CTYPE_HOST:
+		return(((comm_chost_core_t*)handle)->shm->eos);
+#endif /* COMM_CFG_CTYPE_HOST */
+#ifdef COMM_CFG_CTYPE_SOCKET
+	case COMM_CTYPE_SOCKET:
+		csocket_pump(handle, 0);
+		return(((comm_csocket_t*)handle)->eos);
+#endif /* COMM_CFG_CTYPE_SOCKET */
+	default:
+		TRAP(TRAP_INVALID);
+	}
+}
+
+/* ends the stream after the tokens written so far, its reader gets
+   COMM_EOS once they are read; no writes afterwards */
+void comm_close_write(comm_handle_t handle)
+{
+	comm_data_t *data = handle;
+	if(!data || !data->closefn)
+		TRAP(TRAP_INVALID);
+
+	data->closefn(handle);
+	RECFLUSH(data);
+	data->writefn = NULL;
+	data->closefn = NULL;
+}
+
+/* waits until cores 0..n-1 called it; core 0 collects the arrivals
+   and flips the sense, the others spin on it. No atomics needed, the
+   sense of this round can't change before the caller arrives */
+void comm_barrier(volatile comm_barrier_t *b, int n)
+{
+	uint32_t sense = !b->sense;
+	int      polls = 0;
+
+	if(core >= (unsigned)n || n > COMM_CFG_BARRIER_CORES)
+		TRAP(TRAP_INVALID);
+
+#ifdef COMM_PTHREAD
+	__sync_synchronize();	/* publish writes before arriving */
+#endif
+	if(core == 0) {
+		for(int i = 1; i < n; i++)
+			while(b->arrive[i].flag != sense)
+				BARRIER_WAIT(polls);
+		b->sense = sense;
+	} else {
+		b->arrive[core].flag = sense;
+		while(b->sense != sense)
+			BARRIER_WAIT(polls);
+	}
+#ifdef COMM_PTHREAD
+	__sync_synchronize();	/* see others' writes after leaving */
+#endif
+}
+
+/* empties the ports of the calling core and opens closed ones again,
+   for the next stream. Only while no tokens move, and all cores must
+   be done before any writes (comm_barrier()); socket streams can't be
+   rewound */
+void comm_reset(void)
+{
+	for(size_t i = 0; i < COMM_NUM_CHANNELS; i++) {
+		/* channel sources */
+		if(channels[i].src.core == core) {
+			switch(channels[i].type) {
+			case COMM_CTYPE_INVALID:
+				break;
+#ifdef COMM_CFG_CTYPE_DEFAULT
+			case COMM_CTYPE_DEFAULT:
+				cdefault_reset_src(&channels[i]);
+				break;
+#endif /* COMM_CFG_CTYPE_DEFAULT */
+#ifdef COMM_CFG_CTYPE_HOST
+			case COMM_CTYPE_HOST:
+				chost_reset(&channels[i], 1);
+				break;
+#endif /* COMM_CFG_CTYPE_HOST */
+			default:
+				TRAP(TRAP_INVALID);
+			}
+		}
+
+		/* channel destinations */
+		if(channels[i].dst.core == core) {
+			switch(channels[i].type) {
+			case COMM_CTYPE_INVALID:
+				break;
+#ifdef COMM_CFG_CTYPE_DEFAULT
+			case COMM_CTYPE_DEFAULT:
+				cdefault_reset_dst(&channels[i]);
+				break;
+#endif /* COMM_CFG_CTYPE_DEFAULT */
+#ifdef COMM_CFG_CTYPE_HOST
+			case COMM_CTYPE_HOST:
+				chost_reset(&channels[i], 0);
+				break;
+#endif /* COMM_CFG_CTYPE_HOST */
+			default:
+				TRAP(TRAP_INVALID);
+			}
+		}
+	}
+}
@@ -8,6 +8,8 @@
 
 /* global declarations */
 static void kernel(void);
+static void work(comm_handle_t inL, comm_handle_t outL,
+	comm_handle_t inR, comm_handle_t outR);
 
 #define COMM_HEAPSIZE 3300
 
@@ -19,6 +21,7 @@ static void kernel(void);
 	volatile shm_t shm SECTION(".shared_dram");
 	uint32_t core;
 
+	/* on-chip barrier, polling shm in DRAM would be far slower */
 	#define BARRIER do { e_barrier(barriers, tgt_bars); } while(0);
 	volatile e_barrier_t barriers[CORES];
 	         e_barrier_t *tgt_bars[CORES];
@@ -47,35 +50,58 @@ static void kernel(void);
 
 /* === Pthreads kernel boilerplate ===================================== */
 #ifdef COMM_PTHREAD
-	#include <pthread.h>
 	#include <stdio.h>
+	#include <stdlib.h>
+	#include <unistd.h>
 
 	/* globals */
-	extern shm_t shm;
-	__thread uint32_t core;
-
-	/* barrier magic */
-	#define BARRIER do { pthread_barrier_wait(&barrier); } while(0);
-	pthread_barrier_t barrier;
-	void __attribute__((constructor)) barrier_constructor()
-		{ pthread_barrier_init(&barrier, NULL, CORES); }
-
-	/* commlib heap */
-	__thread char commlib_heap[COMM_HEAPSIZE];
+	#define shm (*shm_ptr)
+	#ifdef COMM_FIBER
+		/* cores are fibers sharing threads, per-core data is
+		   found through the running one */
+		#define core ((uint32_t)(uintptr_t)comm_fiber_arg())
+	#else
+		__thread uint32_t core;
+	#endif
+
+	/* threads, fibers and processes alike: barrier lives in shm */
+	#define BARRIER do { comm_barrier(&shm.barrier, CORES); } while(0);
+
+	/* commlib heap, holds ports and rings: it outlives the core's
+	   thread, others may still read from them */
+	static char commlib_heaps[CORES][COMM_HEAPSIZE];
+	#define commlib_heap commlib_heaps[core]
+
+	/* server mode: wait for a job other than 'last' */
+	static uint32_t job_wait(uint32_t last)
+	{
+		while(shm.job == last) {
+		#ifdef COMM_FIBER
+			comm_fiber_yield();
+		#endif
+			usleep(JOB_POLL);
+		}
+		return(shm.job);
+	}
 
 	/* entry point */
 	void* householder_entry(void* id)
 	{
 		/* initialization */
-		core = (uint32_t)id;
+	#ifndef COMM_FIBER
+		core = (uint32_t)(uintptr_t)id;
+	#endif
 
 		/* run kernel */
 		kernel();
 
-		/* finished */
-		while(1) {
-			sched_yield();
-		}
+		/* finished, outputs are closed; a fiber ends, its thread
+		   serves the others, a thread or core process may go, its
+		   ports and rings stay in the heaps or shared memory */
+	#ifdef COMM_PROCESS
+		exit(0);
+	#endif
+		return(NULL);
 	}
 #endif
 
@@ -102,9 +128,58 @@ static void kernel(void)
 	}
 	BARRIER;
 
-	/* early exit for unused cores */
-	if(order[core] >= NCORES)
+#ifdef COMM_PTHREAD
+	/* server mode: jobs until the host quits, each one on emptied
+	   channels; all cores must be done before any is reset, and all
+	   reset before any writes again */
+	if(shm.server) {
+		uint32_t job = 0;
+		while((job = job_wait(job)) != JOB_QUIT) {
+			work(inL, outL, inR, outR);
+			BARRIER;
+			comm_reset();
+			BARRIER;
+			if(core == 0)
+				shm.ready = job;
+		}
 		return;
+	}
+#endif
+
+	work(inL, outL, inR, outR);
+}
+
+/* end this core's streams, the host sees its output closed after
+   the last block; the first core tells the host how it went */
+static void finish(comm_handle_t outL, comm_handle_t outR, uint32_t flag)
+{
+	comm_close_write(outR);
+	if(outL)
+		comm_close_write(outL);
+
+	if(order[core] == 0)
+		shm.flag = flag;
+}
+
+/* one token, or give up if the stream ended early: ending our streams
+   passes that on through the graph */
+#define READ(in, buf) do {                       \
+	if(comm_read(in, buf, 1) != 1) {         \
+		finish(outL, outR, FLAG_SHORT);  \
+		return;                          \
+	}                                        \
+} while(0)
+
+static void work(comm_handle_t inL, comm_handle_t outL,
+	comm_handle_t inR, comm_handle_t outR)
+{
+	/* early exit for unused cores, their streams end right away */
+	if(order[core] >= NCORES) {
+		comm_close_write(outR);
+		if(outL)
+			comm_close_write(outL);
+		return;
+	}
 
 	/* guarantee integer number of columns per core */
 	const int cols = MSIZE/NCORES;
@@ -116,10 +191,10 @@ static void kernel(void)
 
 	/* read input block, then forward remaining blocks */
 	for(int c = 0; c < cols; c++)
-		comm_read(inR, &block[cols-c-1][0], 1);
+		READ(inR, &block[cols-c-1][0]);
 	for(int b = order[core]; b < NCORES-1; b++) {
 		for(int c = 0; c < cols; c++) {
-			comm_read(inR,   &vec[0], 1);
+			READ(inR,        &vec[0]);
 			comm_write(outL, &vec[0], 1);
 		}
 	}
@@ -130,7 +205,7 @@ static void kernel(void)
 			int k = cols * i + cols - c - 1;
 
 			/* forward them */
-			comm_read(inR, &vec[0], 1);
+			READ(inR, &vec[0]);
 			if(order[core] != NCORES-1)
 				comm_write(outL, &vec[0], 1);
 
@@ -187,13 +262,10 @@ static void kernel(void)
 		comm_write(outR, &block[cols-c-1], 1);
 	for(int b = order[core]; b < NCORES-1; b++) {
 		for(int c = 0; c < cols; c++) {
-			comm_read(inL,   &vec[0], 1);
+			READ(inL,        &vec[0]);
 			comm_write(outR, &vec[0], 1);
 		}
 	}
 
-	/* tell host program we're done */
-	if(order[core] == 0) {
-		shm.flag = 1;
-	}
+	finish(outL, outR, FLAG_DONE);
 }
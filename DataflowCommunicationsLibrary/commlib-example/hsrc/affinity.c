@@ -0,0 +1,255 @@
+/* Logical Core to CPU Mapping (pthreads) */
+#ifdef COMM_PTHREAD
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "../shared.h"
+
+#define PRINTF(...) do { fprintf(stderr, __VA_ARGS__); } while(0);
+
+#define MAX_CPUS  CPU_SETSIZE
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu%d/"
+
+/* cpu topology, as far as we care */
+typedef struct {
+	int cpu;
+	int package;	/* socket */
+	int l3;		/* first cpu sharing the L3 cache */
+	int l2;		/* first cpu sharing the L2 cache */
+	int core;	/* physical core id */
+	int smt;	/* index among hyperthread siblings */
+} cpuinfo_t;
+
+/* read first integer from sysfs file, -1 on error;
+   'fmt' takes cpu and (optionally) cache index */
+static int sysfs_int(const char *fmt, int cpu, int idx)
+{
+	char path[128];
+	int  val = -1;
+
+	snprintf(path, sizeof(path), fmt, cpu, idx);
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return(-1);
+	if(fscanf(f, "%d", &val) != 1)
+		val = -1;
+	fclose(f);
+
+	return(val);
+}
+
+/* fill topology information for one cpu */
+static void probe(cpuinfo_t *info, int cpu)
+{
+	info->cpu     = cpu;
+	info->package = sysfs_int(SYSFS_CPU "topology/physical_package_id",
+		cpu, 0);
+	info->core    = sysfs_int(SYSFS_CPU "topology/core_id", cpu, 0);
+	info->l2      = cpu;
+	info->l3      = cpu;
+
+	/* cache sharing: first cpu in shared_cpu_list */
+	for(int idx = 0; idx < 8; idx++) {
+		int level = sysfs_int(SYSFS_CPU "cache/index%d/level",
+			cpu, idx);
+		int first = sysfs_int(SYSFS_CPU "cache/index%d/shared_cpu_list",
+			cpu, idx);
+		if(level < 0)
+			break;
+		if(level == 2) info->l2 = first;
+		if(level == 3) info->l3 = first;
+	}
+
+	/* position among SMT siblings (0 = first thread of core) */
+	info->smt = (sysfs_int(SYSFS_CPU "topology/thread_siblings_list",
+		cpu, 0) == cpu) ? 0 : 1;
+}
+
+/* order cpus: one thread per physical core first, then SMT siblings;
+   within each group keep caches and sockets together */
+static int compare(const void *a, const void *b)
+{
+	const cpuinfo_t *x = a, *y = b;
+
+	if(x->smt     != y->smt)     return(x->smt     - y->smt);
+	if(x->package != y->package) return(x->package - y->package);
+	if(x->l3      != y->l3)      return(x->l3      - y->l3);
+	if(x->l2      != y->l2)      return(x->l2      - y->l2);
+	if(x->core    != y->core)    return(x->core    - y->core);
+	return(x->cpu - y->cpu);
+}
+
+/* order logical cores by walking the channel graph,
+   so that channel neighbours receive neighbouring cpus */
+static void walk(comm_channel_t channels[], int cores, int order[])
+{
+	int visited[cores];
+	int n = 0;
+	memset(visited, 0, sizeof(visited));
+
+	/* start with the core fed by the host, if any */
+	int cur = 0;
+	for(int i = 0; i < COMM_NUM_CHANNELS; i++) {
+		if(channels[i].type == COMM_CTYPE_INVALID)
+			continue;
+		if(channels[i].src.core == -1 &&
+		   channels[i].dst.core >= 0 && channels[i].dst.core < cores) {
+			cur = channels[i].dst.core;
+			break;
+		}
+	}
+
+	while(n < cores) {
+		visited[cur] = 1;
+		order[n++]   = cur;
+
+		/* next: first unvisited neighbour in table order */
+		int next = -1;
+		for(int i = 0; i < COMM_NUM_CHANNELS && next < 0; i++) {
+			int src = channels[i].src.core;
+			int dst = channels[i].dst.core;
+			if(channels[i].type == COMM_CTYPE_INVALID)
+				continue;
+			if(src == cur && dst >= 0 && dst < cores &&
+			   !visited[dst])
+				next = dst;
+			else if(dst == cur && src >= 0 && src < cores &&
+			   !visited[src])
+				next = src;
+		}
+
+		/* dead end: continue with lowest unvisited core */
+		for(int i = 0; i < cores && next < 0; i++)
+			if(!visited[i])
+				next = i;
+
+		if(next < 0)
+			break;
+		cur = next;
+	}
+}
+
+/* fill topology information for the cpus we are allowed to run on,
+   returns their number */
+static int gather(cpuinfo_t info[])
+{
+	cpu_set_t set;
+	int       ncpus = 0;
+
+	if(sched_getaffinity(0, sizeof(set), &set))
+		return(0);
+	for(int cpu = 0; cpu < MAX_CPUS; cpu++)
+		if(CPU_ISSET(cpu, &set))
+			probe(&info[ncpus++], cpu);
+
+	return(ncpus);
+}
+
+/* map logical cores to cpus; returns 0 if threads should not be pinned.
+   COMM_AFFINITY selects the mapping:
+     unset, "auto": topology-aware mapping along the channel graph
+     "none":        don't pin
+     "c0,c1,...":   explicit cpu for each logical core */
+int affinity_map(comm_channel_t channels[], int cores, int cpus[])
+{
+	const char *env = getenv("COMM_AFFINITY");
+
+	if(env && !strcmp(env, "none"))
+		return(0);
+
+	/* explicit list */
+	if(env && strcmp(env, "auto")) {
+		const char *p = env;
+		for(int i = 0; i < cores; i++) {
+			char *end;
+			cpus[i] = strtol(p, &end, 10);
+			if(end == p || cpus[i] < 0 || cpus[i] >= MAX_CPUS) {
+				PRINTF("WARNING: COMM_AFFINITY: bad entry %d, "
+					"not pinning.\n", i);
+				return(0);
+			}
+			p = (*end == ',') ? end + 1 : end;
+			if(*end != ',' && i < cores - 1) {
+				PRINTF("WARNING: COMM_AFFINITY: %d entries "
+					"needed, not pinning.\n", cores);
+				return(0);
+			}
+		}
+		return(1);
+	}
+
+	/* automatic: cpus we are allowed to run on */
+	static cpuinfo_t info[MAX_CPUS];
+	int ncpus = gather(info);
+	if(ncpus == 0)
+		return(0);
+	qsort(info, ncpus, sizeof(info[0]), compare);
+
+	/* assign cpus in topology order along the channel chain */
+	int order[cores];
+	walk(channels, cores, order);
+	for(int i = 0; i < cores; i++)
+		cpus[order[i]] = info[i % ncpus].cpu;
+
+	return(1);
+}
+
+/* cpus for the threads serving host channels, after affinity_map(): a
+   cpu no core runs on, near the core at the other end of the channel
+   (another physical core on its L3 cache, then any on it, then any in
+   its package), a different one for each channel. Without one the
+   thread is not pinned (-1), next to a polling core it would starve */
+void affinity_host(comm_channel_t channels[], int cores, const int cpus[],
+	int host[])
+{
+	static cpuinfo_t info[MAX_CPUS];
+	int ncpus = gather(info);
+	int used[ncpus + 1];
+
+	for(int k = 0; k < ncpus; k++) {
+		used[k] = 0;
+		for(int i = 0; i < cores; i++)
+			if(cpus[i] == info[k].cpu)
+				used[k] = 1;
+	}
+
+	for(int c = 0; c < COMM_NUM_CHANNELS; c++) {
+		host[c] = -1;
+		if(channels[c].type != COMM_CTYPE_HOST)
+			continue;
+		int core = (channels[c].src.core == -1) ?
+			channels[c].dst.core : channels[c].src.core;
+		if(core < 0 || core >= cores)
+			continue;
+
+		/* the core's cpu, if we may run there */
+		cpuinfo_t *near = NULL;
+		for(int k = 0; k < ncpus && !near; k++)
+			if(info[k].cpu == cpus[core])
+				near = &info[k];
+		if(!near)
+			continue;
+
+		int best = -1, score = 0;
+		for(int k = 0; k < ncpus; k++) {
+			int s = (info[k].l3 != near->l3) ?
+				(info[k].package == near->package) :
+				(info[k].l2 != near->l2) ? 3 : 2;
+			if(!used[k] && s > score) {
+				best  = k;
+				score = s;
+			}
+		}
+		if(best >= 0) {
+			used[best] = 1;
+			host[c]    = info[best].cpu;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,252 @@
+/* Copyright (c) 2015 S.Raase. All rights reserved. */
+
+/* Communication Library Source (Host), format adapters */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../commlib.h"
+
+#ifdef COMM_CFG_CTYPE_HOST
+	/* longest value written by f32_format(): "-0.000123456789" */
+	#define F32_WIDTH 16
+
+	/* exact powers of ten in double precision */
+	static const double pow10_tab[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+		1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+		1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+
+	/* value separators, everything else belongs to a value */
+	static const uint8_t f32_sep[256] = {
+		[' ']  = 1, ['\t'] = 1, ['\n'] = 1, ['\r'] = 1,
+		['\v'] = 1, ['\f'] = 1, [',']  = 1, [';']  = 1,
+	};
+
+	/* d * 10^e, dividing by exact powers for e < 0 */
+	static double f32_scale(double d, int e)
+	{
+		if(e >  400) e =  400;
+		if(e < -400) e = -400;
+
+		while(e > 22)  { d *= 1e22; e -= 22; }
+		while(e < -22) { d /= 1e22; e += 22; }
+		return((e < 0) ? d / pow10_tab[-e] : d * pow10_tab[e]);
+	}
+
+	/* parse one value of 'len' bytes: decimal digits are collected
+	   into an integer and scaled once, anything else ("inf", "nan",
+	   hex floats) goes through strtof(); returns 0 on success */
+	static int f32_parse(const char *s, size_t len, float *v)
+	{
+		const char *p = s, *e = s + len;
+		uint64_t    m = 0;
+		int neg = 0, digits = 0, exp10 = 0, seen = 0;
+
+		if(p < e && (*p == '-' || *p == '+'))
+			neg = (*p++ == '-');
+
+		/* integer part, then fraction; digits beyond 19 don't
+		   matter for single precision */
+		for(; p < e && (unsigned)(*p - '0') < 10; p++, seen = 1) {
+			if(digits < 19) {
+				m = m * 10 + (*p - '0');
+				digits += (m != 0);
+			} else {
+				exp10++;
+			}
+		}
+		if(p < e && *p == '.') {
+			for(p++; p < e && (unsigned)(*p - '0') < 10; p++, seen = 1) {
+				if(digits < 19) {
+					m = m * 10 + (*p - '0');
+					digits += (m != 0);
+					exp10--;
+				}
+			}
+		}
+
+		/* exponent */
+		if(seen && p < e && (*p == 'e' || *p == 'E')) {
+			int x = 0, xneg = 0;
+			if(++p < e && (*p == '-' || *p == '+'))
+				xneg = (*p++ == '-');
+			if(p == e)
+				seen = 0;
+			for(; p < e && (unsigned)(*p - '0') < 10; p++)
+				if(x < 10000)
+					x = x * 10 + (*p - '0');
+			exp10 += xneg ? -x : x;
+		}
+
+		if(seen && p == e) {
+			double d = m ? f32_scale((double)m, exp10) : 0.0;
+			*v = (float)(neg ? -d : d);
+			return(0);
+		}
+
+		/* slow path */
+		char  buf[64], *end;
+		if(len >= sizeof(buf))
+			return(-1);
+		memcpy(buf, s, len);
+		buf[len] = '\0';
+		*v = strtof(buf, &end);
+		return((end == buf + len) ? 0 : -1);
+	}
+
+	/* shortest decimal that reads back as 'f' (at most 9 significant
+	   digits); plain notation for exponents -4..8, else scientific.
+	   returns length */
+	static int f32_format(float f, char *dst)
+	{
+		char *p = dst;
+
+		if(isnan(f)) {
+			memcpy(p, "nan", 3);
+			return(3);
+		}
+		if(signbit(f)) {
+			*p++ = '-';
+			f    = -f;
+		}
+		if(isinf(f)) {
+			memcpy(p, "inf", 3);
+			return(p + 3 - dst);
+		}
+		if(f == 0.0f) {
+			*p++ = '0';
+			return(p - dst);
+		}
+
+		/* decimal exponent from the binary one (log10(2) ~ 77/256),
+		   corrected so that 9 digits give 10^8 <= m < 10^9 */
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		int e10 = (((int)(bits >> 23) - 127) * 77) >> 8;
+		uint64_t m;
+		for(;;) {
+			m = (uint64_t)(f32_scale(f, 8 - e10) + 0.5);
+			if(m >= 1000000000)
+				e10++;
+			else if(m < 100000000)
+				e10--;
+			else
+				break;
+		}
+
+		/* drop digits while the value still reads back */
+		int nd = 9;
+		for(int k = 3; k > 0; k--) {
+			uint64_t r = (m + (uint64_t)pow10_tab[k] / 2) /
+				(uint64_t)pow10_tab[k];
+			int      x = e10;
+			if(r >= (uint64_t)pow10_tab[9 - k]) {
+				r /= 10;
+				x++;
+			}
+			if((float)f32_scale((double)r, x - 8 + k) == f) {
+				m   = r;
+				nd  = 9 - k;
+				e10 = x;
+				break;
+			}
+		}
+
+		/* digits, without trailing zeros */
+		char dig[9];
+		for(int i = nd - 1; i >= 0; i--, m /= 10)
+			dig[i] = '0' + m % 10;
+		while(nd > 1 && dig[nd - 1] == '0')
+			nd--;
+
+		if(e10 >= -4 && e10 < 0) {
+			*p++ = '0';
+			*p++ = '.';
+			for(int i = -1; i > e10; i--)
+				*p++ = '0';
+			memcpy(p, dig, nd);
+			p += nd;
+		} else if(e10 >= 0 && e10 < 9) {
+			for(int i = 0; i <= e10; i++)
+				*p++ = (i < nd) ? dig[i] : '0';
+			if(nd > e10 + 1) {
+				*p++ = '.';
+				memcpy(p, dig + e10 + 1, nd - e10 - 1);
+				p += nd - e10 - 1;
+			}
+		} else {
+			*p++ = dig[0];
+			if(nd > 1) {
+				*p++ = '.';
+				memcpy(p, dig + 1, nd - 1);
+				p += nd - 1;
+			}
+			*p++ = 'e';
+			*p++ = (e10 < 0) ? '-' : '+';
+			int x = (e10 < 0) ? -e10 : e10;
+			*p++ = '0' + x / 10;
+			*p++ = '0' + x % 10;
+		}
+
+		return(p - dst);
+	}
+
+	/* text -> floats */
+	static long f32_decode(const char *src, size_t len, int last,
+		uint8_t *dst, size_t max, size_t *out)
+	{
+		size_t pos = 0, n = 0;
+
+		while(n + sizeof(float) <= max) {
+			while(pos < len && f32_sep[(uint8_t)src[pos]])
+				pos++;
+			if(pos == len)
+				break;
+
+			/* value may continue in the next block */
+			size_t end = pos;
+			while(end < len && !f32_sep[(uint8_t)src[end]])
+				end++;
+			if(end == len && !last)
+				break;
+
+			float v;
+			if(f32_parse(src + pos, end - pos, &v))
+				return(-1);
+			memcpy(dst + n, &v, sizeof(float));
+			n  += sizeof(float);
+			pos = end;
+		}
+
+		*out = n;
+		return(pos);
+	}
+
+	/* floats -> text, values of a token on one line */
+	static int f32_encode(const uint8_t *src, int n, uint32_t tsize,
+		char *dst, size_t max, size_t *out)
+	{
+		uint32_t vals = tsize / sizeof(float);
+		size_t   pos  = 0;
+		int      t;
+
+		for(t = 0; t < n && max - pos >= vals * (F32_WIDTH + 1); t++) {
+			for(uint32_t i = 0; i < vals; i++) {
+				float v;
+				memcpy(&v, src + (size_t)t * tsize +
+					i * sizeof(float), sizeof(float));
+				pos += f32_format(v, dst + pos);
+				dst[pos++] = (i + 1 < vals) ? ' ' : '\n';
+			}
+		}
+
+		*out = pos;
+		return(t);
+	}
+
+	const comm_host_codec_t comm_host_codec_f32 = {
+		"text", sizeof(float), F32_WIDTH + 1, f32_decode, f32_encode,
+	};
+#endif /* COMM_CFG_CTYPE_HOST */
@@ -0,0 +1,117 @@
+/* Copyright (c) 2015 S.Raase. All rights reserved. */
+
+/* Communication Library Source (Host), fibers */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "../commlib.h"
+
+#define FAIL(...)   do { fprintf(stderr, __VA_ARGS__); exit(1); } while(0)
+#define PRINTF(...) do { fprintf(stderr, __VA_ARGS__);          } while(0);
+
+#ifdef COMM_PTHREAD
+	typedef struct {
+		ucontext_t   ctx;
+		comm_state_t state;	/* library state of its core */
+		void         *arg;
+		int          done;
+		uint8_t      *stack;
+		size_t       size;	/* of stack mapping, with guard page */
+	} fiber_t;
+
+	/* per thread: fibers, the one running (-1: scheduler) */
+	static __thread fiber_t         *fibers;
+	static __thread int             current = -1;
+	static __thread comm_fiber_fn_t fiber_fn;
+	static __thread ucontext_t      sched_ctx;
+	static __thread comm_state_t    sched_state;
+
+	/* back to the scheduler; called by waiting ports */
+	void comm_fiber_yield(void)
+	{
+		if(current < 0)
+			return;
+
+		fiber_t *f = &fibers[current];
+		comm_switch(&f->state, &sched_state);
+		swapcontext(&f->ctx, &sched_ctx);
+	}
+
+	void* comm_fiber_arg(void)
+	{
+		return((current < 0) ? NULL : fibers[current].arg);
+	}
+
+	/* fiber entry, returns to the scheduler through uc_link */
+	static void fiber_main(void)
+	{
+		fiber_t *f = &fibers[current];
+
+		fiber_fn(f->arg);
+
+		f->done = 1;
+		comm_switch(&f->state, &sched_state);
+	}
+
+	void comm_fiber_run(comm_fiber_fn_t fn, void *args[], int n,
+		size_t stack)
+	{
+		long page = sysconf(_SC_PAGESIZE);
+		stack = (stack + page - 1) & ~(page - 1);
+
+		fibers   = calloc(n, sizeof(fiber_t));
+		fiber_fn = fn;
+		if(!fibers)
+			FAIL("ERROR: can't allocate fibers\n");
+
+		for(int i = 0; i < n; i++) {
+			fiber_t *f = &fibers[i];
+
+			/* stack, overflow hits the guard page below it */
+			f->size  = stack + page;
+			f->stack = mmap(NULL, f->size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+			if(f->stack == MAP_FAILED)
+				FAIL("ERROR: can't allocate fiber stack\n");
+			mprotect(f->stack, page, PROT_NONE);
+
+			getcontext(&f->ctx);
+			f->ctx.uc_stack.ss_sp   = f->stack + page;
+			f->ctx.uc_stack.ss_size = stack;
+			f->ctx.uc_link          = &sched_ctx;
+			makecontext(&f->ctx, fiber_main, 0);
+
+			f->arg         = args[i];
+			f->state.yield = comm_fiber_yield;
+		}
+
+		/* round robin until all are done; a fiber runs until it
+		   waits or ends, then other threads get the cpu */
+		for(int left = n; left; sched_yield()) {
+			for(int i = 0; i < n; i++) {
+				fiber_t *f = &fibers[i];
+				if(f->done)
+					continue;
+
+				current = i;
+				comm_switch(&sched_state, &f->state);
+				swapcontext(&sched_ctx, &f->ctx);
+				current = -1;
+
+				if(f->done) {
+					munmap(f->stack, f->size);
+					left--;
+				}
+			}
+		}
+
+		free(fibers);
+		fibers = NULL;
+	}
+#endif /* COMM_PTHREAD */
@@ -1,158 +1,1384 @@
 /* Copyright (c) 2015 S.Raase. All rights reserved. */
 
 /* Communication Library Source (Host) */
+#define _GNU_SOURCE	/* pthread_attr_setaffinity_np */
 #include <stdio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#ifdef COMM_PTHREAD
+	#include <sys/eventfd.h>
+#endif
 
 #include "../commlib.h"
 
 #define FAIL(...)   do { fprintf(stderr, __VA_ARGS__); exit(1); } while(0)
 #define PRINTF(...) do { fprintf(stderr, __VA_ARGS__);          } while(0);
 
-/* initialize commlib-host */
-int comm_host_init(comm_channel_t channels[COMM_NUM_CHANNELS])
-{
-	for(size_t i = 0; i < COMM_NUM_CHANNELS; i++) {
+#ifdef COMM_PTHREAD
+	#define HUGEPAGE_SIZE (2*1024*1024)
+
+#ifdef COMM_PROCESS
+	comm_arena_t *comm_host_arena = NULL;
+
+	/* core processes: 'size' bytes and an arena of COMM_CFG_PROC_ARENA
+	   bytes for core heaps in one memfd region, mapped shared; cores
+	   forked later see it at the same address. With
+	   COMM_CFG_USE_HUGEPAGES, try reserved huge pages first */
+	static void* proc_alloc(size_t size)
+	{
+		size_t off = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+		size_t len = off + sizeof(comm_arena_t) + COMM_CFG_PROC_ARENA;
+		void  *mem = MAP_FAILED;
+		int    fd;
+
+	#ifdef COMM_CFG_USE_HUGEPAGES
+		len = (len + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+		fd  = memfd_create("commlib", MFD_CLOEXEC | MFD_HUGETLB);
+		if(fd != -1) {
+			if(!ftruncate(fd, len))
+				mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+			close(fd);
+		}
+		if(mem != MAP_FAILED) {
+			PRINTF("Shared memory: %zu kB, memfd, huge pages.\n",
+				len/1024);
+		}
+	#endif
+
+		if(mem == MAP_FAILED) {
+			fd = memfd_create("commlib", MFD_CLOEXEC);
+			if(fd == -1)
+				return(NULL);
+			if(!ftruncate(fd, len))
+				mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+			close(fd);
+			if(mem == MAP_FAILED)
+				return(NULL);
+		#ifdef COMM_CFG_USE_HUGEPAGES
+			madvise(mem, len, MADV_HUGEPAGE);
+		#endif
+			PRINTF("Shared memory: %zu kB, memfd.\n", len/1024);
+		}
+
+		comm_host_arena = (comm_arena_t*)((uint8_t*)mem + off);
+		comm_host_arena->size = len - off - sizeof(comm_arena_t);
+		return(mem);
+	}
+#endif /* COMM_PROCESS */
+
+	/* allocate zeroed memory shared between host and cores; with
+	   COMM_CFG_USE_HUGEPAGES, try reserved huge pages (MAP_HUGETLB),
+	   then transparent huge pages, then normal pages */
+	void* comm_host_alloc(size_t size)
+	{
+		void *mem = MAP_FAILED;
+
+	#ifdef COMM_PROCESS
+		return(proc_alloc(size));
+	#endif
+
+	#ifdef COMM_CFG_USE_HUGEPAGES
+		size_t len = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+
+		mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(mem != MAP_FAILED) {
+			PRINTF("Shared memory: %zu kB, huge pages.\n", len/1024);
+			return(mem);
+		}
+
+		/* over-allocate, THP needs huge page aligned regions */
+		mem = mmap(NULL, len + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem != MAP_FAILED) {
+			uintptr_t base = (uintptr_t)mem;
+			uintptr_t aligned = (base + HUGEPAGE_SIZE - 1) &
+				~(uintptr_t)(HUGEPAGE_SIZE - 1);
+			if(aligned > base)
+				munmap(mem, aligned - base);
+			munmap((void*)(aligned + len),
+				base + HUGEPAGE_SIZE - aligned);
+			mem = (void*)aligned;
+
+			if(madvise(mem, len, MADV_HUGEPAGE) == 0) {
+				PRINTF("Shared memory: %zu kB, "
+					"transparent huge pages.\n", len/1024);
+			} else {
+				PRINTF("Shared memory: %zu kB.\n", len/1024);
+			}
+			return(mem);
+		}
+	#endif
+
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED)
+			return(NULL);
+
+		return(mem);
+	}
+
+	/* host-thread actors: make the calling thread logical core 'core'
+	   of the graph, it then uses comm_read()/comm_write() like a device
+	   core. 'heapsize' bytes hold the ports and rings of this end.
+	   NOTE: core -1 stays reserved for file-backed host channels */
+	int comm_host_attach(comm_channel_t channels[],
+		int core, size_t heapsize)
+	{
+		if(core < 0)
+			FAIL("ERROR: host actor needs a core id >= 0 (%d)\n", core);
+
+		void *heap = malloc(heapsize);
+		if(!heap)
+			FAIL("ERROR: can't allocate heap for host actor %d\n",
+				core);
+
+		return(comm_init(channels, core, heap, heapsize));
+	}
+#endif /* COMM_PTHREAD */
+
 #ifdef COMM_CFG_CTYPE_HOST
-		if(channels[i].type == COMM_CTYPE_HOST) {
-			int source;	/* direction, 1 if host -> device */
-			comm_ctype_host_dsc_t *desc;
+	#ifdef COMM_EPIPHANY
+		#include <e-hal.h>
 
-			/* grab descriptor for channel */
-			if(channels[i].src.core == -1) {
-				source = 1;
-				desc   = (comm_ctype_host_dsc_t*)channels[i].src.hptr;
-			} else if(channels[i].dst.core == -1) {
-				source = 0;
-				desc   = (comm_ctype_host_dsc_t*)channels[i].dst.hptr;
+		#define SHM_READ(DEST, OFF, SIZE, MSG) do {             \
+			if(e_read(emem, 0, 0, OFF, DEST, SIZE) != SIZE) \
+				FAIL(MSG);                              \
+			} while(0);
+
+		#define SHM_WRITE(SRC, OFF, SIZE, MSG) do {             \
+			if(e_write(emem, 0, 0, OFF, SRC, SIZE) != SIZE) \
+				FAIL(MSG);                              \
+			} while(0);
+	#endif
+
+	#ifdef COMM_PTHREAD
+		#define SHM_READ(DEST, OFF, SIZE, MSG) do {      \
+				memcpy(DEST, shmbase+OFF, SIZE); \
+			} while(0);
+
+		#define SHM_WRITE(SRC, OFF, SIZE, MSG) do {      \
+				memcpy(shmbase+OFF, SRC, SIZE);  \
+			} while(0);
+	#endif
+
+	/* host channels served by one thread: comm_host_init() puts all in
+	   'host_main', comm_host_start() hands them to worker threads */
+	typedef struct {
+		int        list[COMM_NUM_CHANNELS];
+		int        num;
+		int        load;	/* max. % of a ring moved in last pass */
+		int        efd;		/* eventfd, rung by cores (pthreads) */
+		useconds_t interval;	/* poll interval (epiphany) */
+		int        cpu;		/* worker cpu, -1 if not pinned */
+		pthread_t  thread;
+		comm_channel_t *channels;
+		void           *param;
+	} host_svc_t;
+
+	static host_svc_t   host_main = { .efd = -1 };
+	static host_svc_t   host_worker[COMM_CFG_HOST_WORKERS + 1];
+	static int          host_workers = 0;
+	static volatile int host_stop    = 0;
+	static int          host_final   = 0;	/* set by comm_host_flush() */
+
+	/* per-pass status, printed by the main loop only */
+	static __thread int host_quiet = 0;
+	#define STATUS(...) do { if(!host_quiet) PRINTF(__VA_ARGS__); } while(0);
+
+	/* tokens to move between rp/wp updates */
+	static int host_chunk(comm_channel_t *ch)
+	{
+		int n = COMM_CFG_HOST_CHUNK / ch->tsize;
+		return((n > 0) ? n : 1);
+	}
+
+	/* wake a waiting service loop */
+	static void host_wake(int efd)
+	{
+		uint64_t one = 1;
+
+		if(efd != -1 && write(efd, &one, sizeof(one)) < 0)
+			;	/* loop will time out */
+	}
+
+	/* move iovecs completely, short only on EOF;
+	   returns number of bytes moved or -1 on error */
+	static ssize_t do_iov(int fd, struct iovec *iov, int cnt, int wr)
+	{
+		ssize_t total = 0;
+
+		while(cnt > 0) {
+			ssize_t ret = wr ? writev(fd, iov, cnt) :
+			                   readv (fd, iov, cnt);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret < 0)
+				return(-1);
+			if(ret == 0)
+				break;	/* eof */
+			total += ret;
+
+			/* skip completed entries, adjust partial one */
+			while(cnt > 0 && (size_t)ret >= iov->iov_len) {
+				ret -= iov->iov_len;
+				iov++; cnt--;
+			}
+			if(cnt > 0) {
+				iov->iov_base  = (uint8_t*)iov->iov_base + ret;
+				iov->iov_len  -= ret;
+			}
+		}
+
+		return(total);
+	}
+
+	/* read from a pipe, FIFO or terminal without blocking. The file
+	   stays blocking, its flags are shared with the caller's shell:
+	   only read if poll() finds data or eof, else fail with EAGAIN */
+	static ssize_t stream_read(int fd, struct iovec *iov, int cnt)
+	{
+		struct pollfd pfd = { fd, POLLIN, 0 };
+
+		int ready = poll(&pfd, 1, 0);
+		if(ready < 0)
+			return(-1);
+		if(ready == 0) {
+			errno = EAGAIN;
+			return(-1);
+		}
+		return(readv(fd, iov, cnt));
+	}
+
+	/* same for one buffer at file offset 'off' */
+	static ssize_t do_at(int fd, uint8_t *buf, size_t len, off_t off, int wr)
+	{
+		size_t total = 0;
+
+		while(total < len) {
+			ssize_t ret = wr ?
+				pwrite(fd, buf + total, len - total, off + total) :
+				pread (fd, buf + total, len - total, off + total);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret < 0)
+				return(-1);
+			if(ret == 0)
+				break;	/* eof */
+			total += ret;
+		}
+
+		return(total);
+	}
+
+	/* copy 'n' tokens from the ring at 'pos' into 'dst',
+	   using (at most) two shared memory transfers */
+	static void ring_get(comm_channel_t *ch, void* param, off_t data,
+		int pos, uint8_t *dst, int n)
+	{
+		#ifdef COMM_EPIPHANY
+			e_mem_t *emem = param;
+		#endif
+
+		#ifdef COMM_PTHREAD
+			void* shmbase = param;
+		#endif
+
+		int tnum  = ch->tnum + 1;
+		int first = (n < tnum - pos) ? n : tnum - pos;
+		if(first > 0)
+			SHM_READ(dst, data + pos * ch->tsize,
+				first * ch->tsize, "rd: shm-read tokens\n");
+		if(n > first)
+			SHM_READ(dst + first * ch->tsize, data,
+				(n - first) * ch->tsize, "rd: shm-read tokens\n");
+	}
+
+	/* copy 'n' tokens from 'src' into the ring at 'pos',
+	   using (at most) two shared memory transfers */
+	static void ring_put(comm_channel_t *ch, void* param, off_t data,
+		int pos, uint8_t *src, int n)
+	{
+		#ifdef COMM_EPIPHANY
+			e_mem_t *emem = param;
+		#endif
+
+		#ifdef COMM_PTHREAD
+			void* shmbase = param;
+		#endif
+
+		int tnum  = ch->tnum + 1;
+		int first = (n < tnum - pos) ? n : tnum - pos;
+		if(first > 0)
+			SHM_WRITE(src, data + pos * ch->tsize,
+				first * ch->tsize, "wr: shm-write tokens\n");
+		if(n > first)
+			SHM_WRITE(src + first * ch->tsize, data,
+				(n - first) * ch->tsize, "wr: shm-write tokens\n");
+	}
+
+	/* map input file for COMM_HOST_MMAP, falls back to read() */
+	static void map_input(comm_channel_t *ch, comm_ctype_host_dsc_t *desc)
+	{
+		struct stat st;
+
+		if(fstat(desc->fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			PRINTF("WARNING: can't map '%s', using read().\n", desc->file);
+			return;
+		}
+		if(st.st_size % ch->tsize)
+			FAIL("ERROR: '%s' is not a multiple of %u bytes\n",
+				desc->file, ch->tsize);
+
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+			desc->fd, 0);
+		if(map == MAP_FAILED) {
+			PRINTF("WARNING: can't map '%s': %s, using read().\n",
+				desc->file, strerror(errno));
+			return;
+		}
+
+		/* streamed front to back, once */
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		desc->map  = map;
+		desc->size = st.st_size;
+	}
+
+	/* make mapped output file hold at least 'need' bytes */
+	static void map_grow(comm_ctype_host_dsc_t *desc, uint64_t need)
+	{
+		if(need <= desc->size)
+			return;
+
+		uint64_t size = desc->size + COMM_CFG_HOST_MAPGROW;
+		if(size < need)
+			size = need;
+		if(ftruncate(desc->fd, size))
+			FAIL("rd: grow '%s': %s\n", desc->file, strerror(errno));
+
+		void *map = desc->map ?
+			mremap(desc->map, desc->size, size, MREMAP_MAYMOVE) :
+			mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				desc->fd, 0);
+		if(map == MAP_FAILED)
+			FAIL("rd: map '%s': %s\n", desc->file, strerror(errno));
+		desc->map  = map;
+		desc->size = size;
+	}
+
+	/* check output file for COMM_HOST_MMAP, falls back to write():
+	   mapping needs a regular file open for reading and writing, and
+	   stdout is never resized, it may be the caller's file */
+	static void map_output(comm_ctype_host_dsc_t *desc)
+	{
+		struct stat st;
+		int         mode = fcntl(desc->fd, F_GETFL);
+		void        *map = MAP_FAILED;
+
+		if(desc->fd != 1 && mode != -1 && (mode & O_ACCMODE) == O_RDWR &&
+		   !fstat(desc->fd, &st) && S_ISREG(st.st_mode)) {
+			if(!ftruncate(desc->fd, COMM_CFG_HOST_MAPGROW))
+				map = mmap(NULL, COMM_CFG_HOST_MAPGROW,
+					PROT_READ | PROT_WRITE, MAP_SHARED,
+					desc->fd, 0);
+			if(map == MAP_FAILED && ftruncate(desc->fd, st.st_size))
+				FAIL("rd: truncate '%s': %s\n", desc->file,
+					strerror(errno));
+		}
+		if(map == MAP_FAILED) {
+			PRINTF("WARNING: can't map '%s', using write().\n",
+				desc->file);
+			desc->flags &= ~COMM_HOST_MMAP;
+			return;
+		}
+
+		desc->map  = map;
+		desc->size = COMM_CFG_HOST_MAPGROW;
+		madvise(desc->map, desc->size, MADV_SEQUENTIAL);
+	}
+
+	/* cut mapped output file to the tokens written */
+	static void unmap_output(comm_channel_t *ch, comm_ctype_host_dsc_t *desc)
+	{
+		uint64_t len = desc->count * ch->tsize;
+
+		munmap(desc->map, desc->size);
+		desc->map  = NULL;
+		desc->size = 0;
+		if(ftruncate(desc->fd, len))
+			FAIL("rd: truncate '%s': %s\n", desc->file, strerror(errno));
+	}
+
+	/* COMM_HOST_ASYNC: file I/O runs in a background thread on ring
+	   sized chunks, so the service loop never waits for disks; outputs
+	   use two chunks, inputs prefetch COMM_CFG_HOST_READAHEAD of them.
+	   One thread per channel: a slow file holds up its stream only */
+	#define AIO_CHUNKS 2
+	enum { AIO_FREE, AIO_BUSY, AIO_READY, AIO_EOF };
+
+	typedef struct {
+		uint8_t *buf;
+		size_t   len;	/* valid bytes (input), bytes to write (output) */
+		size_t   pos;	/* bytes consumed (input) */
+		off_t    off;	/* file offset, the I/O thread may serve
+				   chunks out of order */
+		int      state;	/* AIO_* */
+	} aio_chunk_t;
+
+	typedef struct {
+		int         fd;
+		int         input;	/* direction, 1 if file -> channel */
+		size_t      size;	/* chunk capacity */
+		int         cur;	/* oldest chunk */
+		off_t       next;	/* file offset of the next chunk */
+		int         efd;	/* wakes the serving thread */
+		int         direct;	/* O_DIRECT: whole blocks only */
+		int         nchunks;
+		aio_chunk_t *chunk;
+		int         quit;	/* stop the thread */
+		pthread_t       thread;
+		pthread_mutex_t lock;	/* chunk states, cur, next, efd */
+		pthread_cond_t  cond;
+	} aio_t;
+
+	/* channels with background I/O, for aio_flush() */
+	static aio_t *aio_list[COMM_NUM_CHANNELS];
+	static int    aio_num = 0;
+
+	/* I/O thread of a channel: serve busy chunks, the ones needed
+	   soonest first */
+	static void* aio_thread(void *arg)
+	{
+		aio_t *aio = arg;
+
+		pthread_mutex_lock(&aio->lock);
+		while(!aio->quit) {
+			aio_chunk_t *c = NULL;
+
+			for(int k = 0; !c && k < aio->nchunks; k++) {
+				c = &aio->chunk[(aio->cur + k) % aio->nchunks];
+				if(c->state != AIO_BUSY)
+					c = NULL;
+			}
+			if(!c) {
+				pthread_cond_wait(&aio->cond, &aio->lock);
+				continue;
+			}
+			pthread_mutex_unlock(&aio->lock);
+
+			/* fill or write back the chunk */
+			ssize_t ret = do_at(aio->fd, c->buf,
+				aio->input ? aio->size : c->len, c->off,
+				!aio->input);
+			if(ret < 0 || (!aio->input && (size_t)ret != c->len))
+				FAIL("aio: file-%s: %s\n",
+					aio->input ? "read" : "write",
+					strerror(errno));
+
+			pthread_mutex_lock(&aio->lock);
+			if(aio->input) {
+				c->len   = ret;
+				c->pos   = 0;
+				c->state = AIO_READY;
 			} else {
-				FAIL("ERROR: host channel %2d invalid\n", i);
+				c->len   = 0;
+				c->state = AIO_FREE;
 			}
+			pthread_cond_broadcast(&aio->cond);
+			host_wake(aio->efd);
+		}
+		pthread_mutex_unlock(&aio->lock);
 
-			/* open file if necessary */
-			if(desc->fd == -1) {
-				if(source) {
-					/* source file */
-					desc->fd = open(desc->file, O_RDONLY);
-				} else {
-					/* handle magic name "stdout" */
-					if(!strcmp(desc->file, "stdout")) {
-						desc->fd = 1;
-					} else {
-						desc->fd = open(desc->file,
-							O_WRONLY | O_CREAT |
-							O_TRUNC, 0666);
-					}
-				}
+		return(NULL);
+	}
 
-				/* fail on error */
-				if(desc->fd == -1) {
-					FAIL("ERROR: can't open '%s': %s\n",
-						desc->file, strerror(errno));
+	/* hand the oldest chunk to the I/O thread, with the next part of
+	   the file; the one after it becomes the oldest */
+	static void aio_submit(aio_t *aio)
+	{
+		aio_chunk_t *c = &aio->chunk[aio->cur];
+
+		pthread_mutex_lock(&aio->lock);
+		c->off     = aio->next;
+		aio->next += aio->input ? aio->size : c->len;
+		aio->cur   = (aio->cur + 1) % aio->nchunks;
+		c->state   = AIO_BUSY;
+		pthread_cond_broadcast(&aio->cond);
+		pthread_mutex_unlock(&aio->lock);
+	}
+
+	/* chunk state, as seen by the service loop */
+	static int aio_state(aio_t *aio, aio_chunk_t *c)
+	{
+		pthread_mutex_lock(&aio->lock);
+		int state = c->state;
+		pthread_mutex_unlock(&aio->lock);
+		return(state);
+	}
+
+	/* wake 'efd' on finished chunks from now on */
+	static void aio_wakes(aio_t *aio, int efd)
+	{
+		pthread_mutex_lock(&aio->lock);
+		aio->efd = efd;
+		pthread_mutex_unlock(&aio->lock);
+	}
+
+	/* set up async I/O for a channel, with its own I/O thread */
+	static void aio_setup(comm_channel_t *ch,
+		comm_ctype_host_dsc_t *desc, int input)
+	{
+		aio_t *aio = calloc(1, sizeof(aio_t));
+		if(!aio)
+			FAIL("ERROR: can't allocate aio state\n");
+		aio->fd    = desc->fd;
+		aio->input = input;
+		aio->size  = (size_t)ch->tsize * ch->tnum;
+		aio->efd   = host_main.efd;
+		aio->next  = lseek(desc->fd, 0, SEEK_CUR);
+		if(aio->next < 0)
+			aio->next = 0;
+
+		/* O_DIRECT: chunks of whole tokens and whole blocks */
+		if(desc->flags & COMM_HOST_DIRECT) {
+			size_t a = ch->tsize, b = COMM_CFG_HOST_DIRECT_ALIGN;
+			while(b) { size_t t = a % b; a = b; b = t; }
+			size_t unit = ch->tsize / a * COMM_CFG_HOST_DIRECT_ALIGN;
+			aio->size   = (aio->size + unit - 1) / unit * unit;
+			aio->direct = 1;
+		}
+
+		/* read-ahead window, in rings */
+		aio->nchunks = AIO_CHUNKS;
+		if(input && COMM_CFG_HOST_READAHEAD > AIO_CHUNKS)
+			aio->nchunks = COMM_CFG_HOST_READAHEAD;
+		aio->chunk = calloc(aio->nchunks, sizeof(aio_chunk_t));
+		if(!aio->chunk)
+			FAIL("ERROR: can't allocate aio state\n");
+		for(int k = 0; k < aio->nchunks; k++) {
+			void *buf;
+			if(posix_memalign(&buf, COMM_CFG_HOST_DIRECT_ALIGN,
+				aio->size))
+					FAIL("ERROR: can't allocate aio chunk\n");
+			aio->chunk[k].buf = buf;
+		}
+
+		pthread_mutex_init(&aio->lock, NULL);
+		pthread_cond_init(&aio->cond, NULL);
+		if(pthread_create(&aio->thread, NULL, aio_thread, aio))
+			FAIL("ERROR: can't create aio thread\n");
+		aio_list[aio_num++] = aio;
+		desc->priv = aio;
+
+		/* start reading ahead, all chunks: back at the first */
+		if(input)
+			for(int k = 0; k < aio->nchunks; k++)
+				aio_submit(aio);
+	}
+
+	/* move ready input chunks into the ring, returns tokens written */
+	static int fill_aio(comm_channel_t *ch, void* param,
+		off_t data, int wp, int space)
+	{
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+		aio_t *aio  = desc->priv;
+		int   tnum  = ch->tnum + 1;
+		int   tokens = 0;
+
+		while(tokens < space) {
+			aio_chunk_t *c = &aio->chunk[aio->cur];
+			if(aio_state(aio, c) != AIO_READY)
+				break;	/* in flight or done */
+
+			if(c->len % ch->tsize) {
+				PRINTF("WARNING: '%s' ends in a partial token, "
+					"dropped.\n", desc->file);
+				c->len -= c->len % ch->tsize;
+			}
+
+			/* copy what fits */
+			int avail = (c->len - c->pos) / ch->tsize;
+			int n     = (avail < space - tokens) ?
+				avail : space - tokens;
+			ring_put(ch, param, data, (wp + tokens) % tnum,
+				c->buf + c->pos, n);
+			c->pos += n * ch->tsize;
+			tokens += n;
+
+			/* chunk consumed: refill, unless file ended */
+			if(c->pos == c->len) {
+				if(c->len < aio->size) {
+					c->state  = AIO_EOF;
+					desc->eof = 1;
+					break;
 				}
+				aio_submit(aio);
 			}
+		}
 
-			PRINTF("Host channel %2zu: fd %2i, %s file '%s'.\n",
-				i, desc->fd,
-				source ? " input" : "output", desc->file);
+		return(tokens);
+	}
+
+	/* move up to 'level' tokens into a free output chunk,
+	   returns tokens read */
+	static int drain_aio(comm_channel_t *ch, void* param,
+		off_t data, int rp, int level)
+	{
+		comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+		aio_t *aio = desc->priv;
+
+		aio_chunk_t *c = &aio->chunk[aio->cur];
+		if(level == 0 || aio_state(aio, c) != AIO_FREE)
+			return(0);	/* both chunks in flight */
+
+		int n = (aio->size - c->len) / ch->tsize;
+		if(n > level)
+			n = level;
+		ring_get(ch, param, data, rp, c->buf + c->len, n);
+		c->len += n * ch->tsize;
+
+		/* O_DIRECT writes full chunks, the tail goes via aio_tail() */
+		if(!aio->direct || c->len == aio->size)
+			aio_submit(aio);
+
+		return(n);
+	}
+
+	/* write a partial O_DIRECT output chunk, buffered */
+	static void aio_tail(comm_ctype_host_dsc_t *desc)
+	{
+		aio_t       *aio = desc->priv;
+		aio_chunk_t *c   = &aio->chunk[aio->cur];
+
+		if(aio->input || aio_state(aio, c) != AIO_FREE || c->len == 0)
+			return;
+
+		int fl = fcntl(aio->fd, F_GETFL);
+		if(fl == -1 || fcntl(aio->fd, F_SETFL, fl & ~O_DIRECT))
+			FAIL("rd: leave direct I/O: %s\n", strerror(errno));
+		aio_submit(aio);
+	}
+
+	/* release async I/O of a channel, once no chunk is in flight */
+	static void aio_release(comm_ctype_host_dsc_t *desc)
+	{
+		aio_t *aio = desc->priv;
+
+		pthread_mutex_lock(&aio->lock);
+		for(int k = 0; k < aio->nchunks; k++)
+			while(aio->chunk[k].state == AIO_BUSY)
+				pthread_cond_wait(&aio->cond, &aio->lock);
+		aio->quit = 1;
+		pthread_cond_broadcast(&aio->cond);
+		pthread_mutex_unlock(&aio->lock);
+		pthread_join(aio->thread, NULL);
+		pthread_mutex_destroy(&aio->lock);
+		pthread_cond_destroy(&aio->cond);
+
+		for(int i = 0; i < aio_num; i++)
+			if(aio_list[i] == aio)
+				aio_list[i--] = aio_list[--aio_num];
+
+		for(int k = 0; k < aio->nchunks; k++)
+			free(aio->chunk[k].buf);
+		free(aio->chunk);
+		free(aio);
+		desc->priv = NULL;
+	}
+
+	/* wait until all output chunks are written */
+	static void aio_flush(void)
+	{
+		for(int i = 0; i < aio_num; i++) {
+			aio_t *aio = aio_list[i];
+			if(aio->input)
+				continue;
+
+			pthread_mutex_lock(&aio->lock);
+			for(int k = 0; k < aio->nchunks; k++)
+				while(aio->chunk[k].state == AIO_BUSY)
+					pthread_cond_wait(&aio->cond, &aio->lock);
+			pthread_mutex_unlock(&aio->lock);
+		}
+	}
+
+	/* write up to 'level' tokens from the ring to file,
+	   returns tokens read */
+	static int drain_file(comm_channel_t *ch, void* param,
+		off_t data, int rp, int level)
+	{
+		comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+		int tnum = ch->tnum + 1;
+
+		#ifdef COMM_PTHREAD
+			void* shmbase = param;
+		#endif
+
+		/* small amounts: collect in coalescing buffer */
+		size_t len = (size_t)level * ch->tsize;
+		if(desc->cbuf && desc->cfill + len <= COMM_CFG_HOST_COALESCE) {
+			ring_get(ch, param, data, rp,
+				desc->cbuf + desc->cfill, level);
+			desc->cfill += len;
+			return(level);
+		}
+
+		/* collected tokens, then (at most) two contiguous ring regions */
+		int first = (level < tnum - rp) ? level : tnum - rp;
+		struct iovec iov[3] = {
+			{ desc->cbuf, desc->cfill                },
+			{ NULL,       first           * ch->tsize },
+			{ NULL,       (level - first) * ch->tsize },
+		};
+
+		#ifdef COMM_EPIPHANY
+			/* fetch regions into staging buffer */
+			ring_get(ch, param, data, rp, desc->buf, level);
+			iov[1].iov_base = desc->buf;
+			iov[2].iov_base = desc->buf + iov[1].iov_len;
+		#endif
+
+		#ifdef COMM_PTHREAD
+			/* write straight from shared memory */
+			iov[1].iov_base = shmbase + data + rp * ch->tsize;
+			iov[2].iov_base = shmbase + data;
+		#endif
+
+		/* write collected and new tokens to file */
+		if(level > 0) {
+			if(do_iov(desc->fd, iov, 3, 1) !=
+				(ssize_t)(desc->cfill + len))
+					FAIL("rd: file-write tokens: %s\n",
+						strerror(errno));
+			desc->cfill = 0;
+		}
+
+		return(level);
+	}
+
+	/* copy 'level' tokens into the mapped output file,
+	   returns tokens read */
+	static int drain_mmap(comm_channel_t *ch, void* param,
+		off_t data, int rp, int level)
+	{
+		comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+		uint64_t off = desc->count * ch->tsize;
+		uint64_t len = (uint64_t)level * ch->tsize;
+
+		map_grow(desc, off + len);
+		ring_get(ch, param, data, rp, desc->map + off, level);
+
+		/* start writeback for each completed step */
+		uint64_t from = off         / COMM_CFG_HOST_WRITEBACK;
+		uint64_t to   = (off + len) / COMM_CFG_HOST_WRITEBACK;
+		if(to > from)
+			sync_file_range(desc->fd, from * COMM_CFG_HOST_WRITEBACK,
+				(to - from) * COMM_CFG_HOST_WRITEBACK,
+				SYNC_FILE_RANGE_WRITE);
+
+		return(level);
+	}
+
+	/* write out coalescing buffer */
+	static void drain_cbuf(comm_ctype_host_dsc_t *desc)
+	{
+		struct iovec iov = { desc->cbuf, desc->cfill };
+
+		if(desc->cfill &&
+		   do_iov(desc->fd, &iov, 1, 1) != (ssize_t)desc->cfill)
+			FAIL("rd: file-write tokens: %s\n", strerror(errno));
+		desc->cfill = 0;
+	}
+
+#ifdef COMM_PTHREAD
+	/* COMM_HOST_SPLICE: hand ring regions to the output pipe with
+	   vmsplice(). The pipe references ring memory, so tokens are only
+	   released (rp advanced) once the reader has consumed them;
+	   returns tokens released */
+	static int drain_splice(comm_channel_t *ch, void* param,
+		off_t data, int rp, int level)
+	{
+		comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+		void*  shmbase = param;
+		size_t ring    = (size_t)(ch->tnum + 1) * ch->tsize;
+
+		/* hand over what is not in the pipe yet */
+		size_t start = ((size_t)rp * ch->tsize + desc->held) % ring;
+		size_t left  = (size_t)level * ch->tsize - desc->held;
+		while(left > 0) {
+			size_t len = (left < ring - start) ? left : ring - start;
+			struct iovec iov = { shmbase + data + start, len };
+			ssize_t ret = vmsplice(desc->fd, &iov, 1,
+				host_final ? 0 : SPLICE_F_NONBLOCK);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret < 0 && errno == EAGAIN && !host_final)
+				break;	/* pipe full */
+			if(ret < 0 && errno == EAGAIN) {
+				struct pollfd pfd = { desc->fd, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			if(ret < 0)
+				FAIL("rd: vmsplice tokens: %s\n", strerror(errno));
+			desc->held += ret;
+			left       -= ret;
+			start       = (start + ret) % ring;
+		}
+
+		/* last pass: ring is not written anymore */
+		if(host_final) {
+			desc->held = 0;
+			return(level);
+		}
+
+		/* release tokens the reader consumed */
+		int queued = 0;
+		if(ioctl(desc->fd, FIONREAD, &queued) < 0)
+			FAIL("rd: pipe level: %s\n", strerror(errno));
+		long done = ((long)desc->held - queued) / ch->tsize;
+		if(done <= 0)
+			return(0);
+		desc->held -= (size_t)done * ch->tsize;
+		return(done);
+	}
+#endif /* COMM_PTHREAD */
+
+	/* format adapters (desc->codec): text is converted to and from
+	   tokens in these buffers, by the thread serving the channel */
+	typedef struct {
+		char     *txt;
+		size_t   tpos, tlen, tcap;	/* text used, held, capacity */
+		uint8_t  *bin;
+		size_t   bpos, blen, bcap;	/* token bytes, same */
+		uint64_t base;	/* file offset of txt[0] (input) */
+		int      end;	/* input: file exhausted */
+		int      ready;	/* input: ring filled before text ran out */
+		int      pipe;	/* output: not a regular file, write often */
+	} text_t;
+
+	static void text_setup(comm_channel_t *ch, comm_ctype_host_dsc_t *desc)
+	{
+		const comm_host_codec_t *codec = desc->codec;
+		struct stat st;
+
+		if(ch->tsize % codec->esize)
+			FAIL("ERROR: '%s': %s needs tokens of %u byte values\n",
+				desc->file, codec->name, codec->esize);
+
+		text_t *t = calloc(1, sizeof(text_t));
+		if(!t)
+			FAIL("ERROR: can't allocate text buffers\n");
+		t->tcap = (size_t)ch->tsize / codec->esize * codec->width;
+		if(t->tcap < COMM_CFG_HOST_TEXTBUF)
+			t->tcap = COMM_CFG_HOST_TEXTBUF;
+		t->bcap = (size_t)host_chunk(ch) * ch->tsize;
+		t->txt  = malloc(t->tcap);
+		t->bin  = malloc(t->bcap);
+		if(!t->txt || !t->bin)
+			FAIL("ERROR: can't allocate text buffers\n");
+		t->pipe = fstat(desc->fd, &st) || !S_ISREG(st.st_mode);
+		desc->text = t;
+	}
+
+	/* write out converted text */
+	static void text_flush(comm_ctype_host_dsc_t *desc)
+	{
+		text_t *t = desc->text;
+		struct iovec iov = { t->txt, t->tlen };
+
+		if(t->tlen && do_iov(desc->fd, &iov, 1, 1) != (ssize_t)t->tlen)
+			FAIL("rd: file-write text: %s\n", strerror(errno));
+		t->tlen = 0;
+	}
+
+	/* format 'level' tokens into the text buffer, writing it out
+	   when full; returns tokens read */
+	static int drain_text(comm_channel_t *ch, void* param,
+		off_t data, int rp, int level)
+	{
+		comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+		text_t *t = desc->text;
+
+		ring_get(ch, param, data, rp, t->bin, level);
+		for(int done = 0; done < level; ) {
+			size_t out;
+			done += desc->codec->encode(t->bin + (size_t)done * ch->tsize,
+				level - done, ch->tsize,
+				t->txt + t->tlen, t->tcap - t->tlen, &out);
+			t->tlen += out;
+			if(done < level)
+				text_flush(desc);
+		}
+
+		/* pipes and terminals: pass on what we have */
+		if(t->pipe)
+			text_flush(desc);
+
+		return(level);
+	}
+
+	/* parse up to 'space' tokens at 'wp' from the file's text; values
+	   and tokens split across reads are kept for the next call.
+	   returns tokens written */
+	static int fill_text(comm_channel_t *ch, void* param,
+		off_t data, int wp, int space)
+	{
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+		text_t *t      = desc->text;
+		int    tnum    = ch->tnum + 1;
+		int    tokens  = 0;
+
+		t->ready = 0;
+		while(tokens < space) {
+			/* publish whole tokens */
+			int n = (t->blen - t->bpos) / ch->tsize;
+			if(n > space - tokens)
+				n = space - tokens;
+			if(n > 0) {
+				ring_put(ch, param, data, (wp + tokens) % tnum,
+					t->bin + t->bpos, n);
+				t->bpos += (size_t)n * ch->tsize;
+				tokens  += n;
+				continue;
+			}
+
+			/* convert more text */
+			memmove(t->bin, t->bin + t->bpos, t->blen - t->bpos);
+			t->blen -= t->bpos;
+			t->bpos  = 0;
+
+			size_t out;
+			long used = desc->codec->decode(t->txt + t->tpos,
+				t->tlen - t->tpos, t->end,
+				t->bin + t->blen, t->bcap - t->blen, &out);
+			if(used < 0)
+				FAIL("wr: '%s': malformed value near byte %llu\n",
+					desc->file,
+					(unsigned long long)(t->base + t->tpos));
+			t->tpos += used;
+			t->blen += out;
+			if(out > 0 || used > 0)
+				continue;
+
+			/* read more text */
+			if(t->end) {
+				if(t->blen)
+					PRINTF("WARNING: '%s' ends in a partial "
+						"token, dropped.\n", desc->file);
+				t->blen   = 0;
+				desc->eof = 1;
+				return(tokens);
+			}
+			memmove(t->txt, t->txt + t->tpos, t->tlen - t->tpos);
+			t->base += t->tpos;
+			t->tlen -= t->tpos;
+			t->tpos  = 0;
+			if(t->tlen == t->tcap)
+				FAIL("wr: '%s': value too long near byte %llu\n",
+					desc->file, (unsigned long long)t->base);
+
+			struct iovec iov = { t->txt + t->tlen, t->tcap - t->tlen };
+			ssize_t ret = stream_read(desc->fd, &iov, 1);
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return(tokens);	/* stream dry */
+			if(ret < 0)
+				FAIL("wr: file-read text: %s\n", strerror(errno));
+			if(ret == 0)
+				t->end   = 1;
+			t->tlen += ret;
+		}
+
+		t->ready = 1;
+		return(tokens);
+	}
+
+	/* read from channel into file */
+	static int do_read(comm_channel_t *ch, void* param)
+	{
+		off_t shmoff = (off_t)ch->dst.dptr.off;
+		comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+		comm_chost_shm_t      meta;	/* metadata: rp, wp */
+
+		#ifdef COMM_EPIPHANY
+			e_mem_t *emem = param;
+		#endif
+
+		#ifdef COMM_PTHREAD
+			void* shmbase = param;
+		#endif
+
+		if(ch->dst.core != -1) FAIL("rd: invalid channel\n");
+		if(desc->fd == -1)     FAIL("rd: invalid file\n");
+
+		int tnum = ch->tnum + 1;
+
+		/* read metadata, calculate number of tokens to read */
+		SHM_READ(&meta, shmoff, sizeof(meta),
+			"rd: shm-read meta\n");
+		int level = (tnum + meta.wp - meta.rp) % tnum;
+
+		/* drain ring, to text, mapping, file, background writer or pipe;
+		   free each chunk as soon as it is written */
+		off_t   data   = shmoff + sizeof(comm_chost_shm_t);
+		off_t   offset = shmoff + offsetof(comm_chost_shm_t, rp);
+		int32_t newrp  = meta.rp;
+		int     chunk  = host_chunk(ch);
+		for(int done = 0; done < level; ) {
+			int n = (level - done < chunk) ? level - done : chunk;
+			int tokens;
+		#ifdef COMM_PTHREAD
+			if(desc->flags & COMM_HOST_SPLICE)
+				tokens = drain_splice(ch, param, data, newrp,
+					level - done);
+			else
+		#endif
+			tokens = desc->text ?
+				drain_text(ch, param, data, newrp, n) :
+				desc->map  ?
+				drain_mmap(ch, param, data, newrp, n) :
+				desc->priv ?
+				drain_aio (ch, param, data, newrp, n) :
+				drain_file(ch, param, data, newrp, n);
+			if(tokens == 0)
+				break;
+			desc->count += tokens;
+			done        += tokens;
+
+			/* update metadata (rp field only) */
+			newrp = (newrp + tokens) % tnum;
+			SHM_WRITE(&newrp, offset, sizeof(newrp),
+				"rd: shm-write meta\n");
+		}
+		/* closed by the core: done once the last wp is drained,
+		   which may have landed after the snapshot */
+		if(meta.eos && !desc->eof) {
+			SHM_READ(&meta.wp, shmoff + offsetof(comm_chost_shm_t, wp),
+				sizeof(meta.wp), "rd: shm-read meta\n");
+			desc->eof = (newrp == meta.wp);
+		}
+		STATUS("rd: (%2d/%2d | %llu) ", newrp, meta.wp,
+			(unsigned long long)desc->count);
+
+		/* return number of tokens read for this channel */
+		return(desc->count);
+	}
+
+	/* fill 'space' tokens at 'wp' from file, returns tokens written */
+	static int fill_file(comm_channel_t *ch, void* param,
+		off_t data, int wp, int space)
+	{
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+		int tnum = ch->tnum + 1;
+
+		#ifdef COMM_PTHREAD
+			void* shmbase = param;
+		#endif
+
+		/* split into (at most) two contiguous ring regions */
+		int first = (space < tnum - wp) ? space : tnum - wp;
+		struct iovec iov[2] = {
+			{ NULL, first           * ch->tsize },
+			{ NULL, (space - first) * ch->tsize },
+		};
+
+		#ifdef COMM_EPIPHANY
+			/* read into staging buffer */
+			iov[0].iov_base = desc->buf;
+			iov[1].iov_base = desc->buf + iov[0].iov_len;
+		#endif
+
+		#ifdef COMM_PTHREAD
+			/* read straight into shared memory */
+			iov[0].iov_base = shmbase + data + wp * ch->tsize;
+			iov[1].iov_base = shmbase + data;
+		#endif
+
+		/* read tokens from file, short on eof only */
+		int tokens = 0;
+		if(space > 0) {
+			ssize_t ret = do_iov(desc->fd, iov, 2, 0);
+			if(ret < 0)
+				FAIL("wr: file-read tokens: %s\n", strerror(errno));
+			if(ret % ch->tsize)
+				PRINTF("WARNING: '%s' ends in a partial token, "
+					"dropped.\n", desc->file);
+			tokens = ret / ch->tsize;
+			desc->eof = (tokens < space);
+		}
+
+		#ifdef COMM_EPIPHANY
+			/* push regions to shared memory */
+			ring_put(ch, param, data, wp, desc->buf, tokens);
+		#endif
+
+		return(tokens);
+	}
+
+	/* stream read that moved no data: check for eof and errors */
+	static void stream_idle(comm_ctype_host_dsc_t *desc, ssize_t ret)
+	{
+		if(ret == 0) {
+			if(desc->plen)
+				PRINTF("WARNING: '%s' ends in a partial token, "
+					"dropped.\n", desc->file);
+			desc->plen = 0;
+			desc->eof  = 1;
+		} else if(errno != EAGAIN && errno != EWOULDBLOCK &&
+		          errno != EINTR) {
+			FAIL("wr: stream-read tokens: %s\n", strerror(errno));
+		}
+	}
+
+	/* fill up to 'space' tokens at 'wp' with what the stream holds
+	   right now; a trailing partial token is kept for the next call.
+	   returns tokens written */
+	static int fill_stream(comm_channel_t *ch, void* param,
+		off_t data, int wp, int space)
+	{
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+		int tnum   = ch->tnum + 1;
+		int tokens = 0;
+
+		#ifdef COMM_PTHREAD
+			void* shmbase = param;
+		#endif
+
+		if(space <= 0)
+			return(0);
+
+		/* complete partial token first */
+		if(desc->plen > 0) {
+			struct iovec iov = { desc->part + desc->plen,
+				ch->tsize - desc->plen };
+			ssize_t ret = stream_read(desc->fd, &iov, 1);
+			if(ret <= 0) {
+				stream_idle(desc, ret);
+				return(0);
+			}
+			desc->plen += ret;
+			if(desc->plen < ch->tsize)
+				return(0);
+
+			ring_put(ch, param, data, wp, desc->part, 1);
+			desc->plen = 0;
+			tokens = 1;
+			wp     = (wp + 1) % tnum;
+			if(--space == 0)
+				return(tokens);
+		}
+
+		/* split into (at most) two contiguous ring regions */
+		int first = (space < tnum - wp) ? space : tnum - wp;
+		struct iovec iov[2] = {
+			{ NULL, first           * ch->tsize },
+			{ NULL, (space - first) * ch->tsize },
+		};
+
+		#ifdef COMM_EPIPHANY
+			iov[0].iov_base = desc->buf;
+			iov[1].iov_base = desc->buf + iov[0].iov_len;
+		#endif
+
+		#ifdef COMM_PTHREAD
+			iov[0].iov_base = shmbase + data + wp * ch->tsize;
+			iov[1].iov_base = shmbase + data;
+		#endif
 
+		/* single non-blocking read */
+		ssize_t ret = stream_read(desc->fd, iov, 2);
+		if(ret <= 0) {
+			stream_idle(desc, ret);
+			return(tokens);
 		}
-#endif /* COMM_CFG_CTYPE_HOST */
+		int n      = ret / ch->tsize;
+		desc->plen = ret % ch->tsize;
+
+		/* publish whole tokens, keep the rest */
+		#ifdef COMM_EPIPHANY
+			ring_put(ch, param, data, wp, desc->buf, n);
+			memcpy(desc->part, desc->buf + n * ch->tsize, desc->plen);
+		#endif
+
+		#ifdef COMM_PTHREAD
+			memcpy(desc->part, shmbase + data +
+				((wp + n) % tnum) * ch->tsize, desc->plen);
+		#endif
+
+		return(tokens + n);
 	}
 
-	return(0);
-}
+	/* fill 'space' tokens at 'wp' from mapping, returns tokens written */
+	static int fill_mmap(comm_channel_t *ch, void* param,
+		off_t data, int wp, int space)
+	{
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+		int tnum = ch->tnum + 1;
 
-#ifdef COMM_CFG_CTYPE_HOST
-	#ifdef COMM_EPIPHANY
-		#include <e-hal.h>
+		/* limit to tokens left in file */
+		uint64_t left = desc->size / ch->tsize - desc->count;
+		int tokens = (left < (uint64_t)space) ? (int)left : space;
+		desc->eof  = (left == (uint64_t)tokens);
+		if(tokens <= 0)
+			return(0);
 
-		#define SHM_READ(DEST, OFF, SIZE, MSG) do {             \
-			if(e_read(emem, 0, 0, OFF, DEST, SIZE) != SIZE) \
-				FAIL(MSG);                              \
-			} while(0);
+		/* copy (at most) two contiguous runs into the ring */
+		uint8_t *src = desc->map + desc->count * ch->tsize;
+		size_t   len = tokens * ch->tsize;
+		ring_put(ch, param, data, wp, src, tokens);
 
-		#define SHM_WRITE(SRC, OFF, SIZE, MSG) do {             \
-			if(e_write(emem, 0, 0, OFF, SRC, SIZE) != SIZE) \
-				FAIL(MSG);                              \
-			} while(0);
-	#endif
+		/* drop consumed pages, hint readahead of the next ring */
+		long     page = sysconf(_SC_PAGESIZE);
+		uint8_t *from = (uint8_t*)((uintptr_t)src         & ~(page - 1));
+		uint8_t *done = (uint8_t*)((uintptr_t)(src + len) & ~(page - 1));
+		if(done > from)
+			madvise(from, done - from, MADV_DONTNEED);
 
-	#ifdef COMM_PTHREAD
-		#define SHM_READ(DEST, OFF, SIZE, MSG) do {      \
-				memcpy(DEST, shmbase+OFF, SIZE); \
-			} while(0);
+		size_t ahead = (size_t)tnum * ch->tsize;
+		if(ahead > (size_t)(desc->map + desc->size - done))
+			ahead = desc->map + desc->size - done;
+		if(ahead)
+			madvise(done, ahead, MADV_WILLNEED);
 
-		#define SHM_WRITE(SRC, OFF, SIZE, MSG) do {      \
-				memcpy(shmbase+OFF, SRC, SIZE);  \
-			} while(0);
-	#endif
+		return(tokens);
+	}
 
-	/* read from channel into file */
-	static int do_read(comm_channel_t *ch, void* param)
+	/* COMM_HOST_REPLAY: tokens come from a log written with
+	   COMM_FLAG_RECORD, at full speed or, with COMM_HOST_TIMED, spaced
+	   out as they were recorded */
+	typedef struct {
+		FILE     *file;
+		uint8_t  *buf;	/* tokens on their way into the ring */
+		uint32_t left;	/* tokens of current record not moved yet */
+		uint64_t next;	/* index of next token expected */
+		uint64_t stamp;	/* time of current record (ns) */
+		uint64_t first;	/* time of first record */
+		uint64_t start;	/* host time of first record */
+		int      stamps;	/* log has timestamps */
+		int      timed;
+	} replay_t;
+
+	/* monotonic time in ns, same clock as the recorder */
+	static uint64_t host_now(void)
 	{
-		off_t shmoff = (off_t)ch->dst.dptr;
-		comm_ctype_host_dsc_t *desc =
-			(comm_ctype_host_dsc_t*)ch->dst.hptr;
-		comm_chost_shm_t      meta;	/* metadata: rp, wp */
+		struct timespec ts;
 
-		#ifdef COMM_EPIPHANY
-			e_mem_t *emem = param;
-		#endif
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+	}
 
-		#ifdef COMM_PTHREAD
-			void* shmbase = param;
-		#endif
+	static void replay_setup(comm_channel_t *ch, comm_ctype_host_dsc_t *desc)
+	{
+		comm_rec_hdr_t hdr;
 
-		if(ch->dst.core != -1) FAIL("rd: invalid channel\n");
-		if(desc->fd == -1)     FAIL("rd: invalid file\n");
+		replay_t *r = calloc(1, sizeof(replay_t));
+		if(!r)
+			FAIL("ERROR: can't allocate replay state\n");
+		r->file = fdopen(desc->fd, "rb");
+		r->buf  = malloc((size_t)host_chunk(ch) * ch->tsize);
+		if(!r->file || !r->buf)
+			FAIL("ERROR: can't allocate replay state\n");
+		setvbuf(r->file, NULL, _IOFBF, COMM_CFG_HOST_CHUNK);
 
-		int tnum = ch->tnum + 1;
+		if(fread(&hdr, sizeof(hdr), 1, r->file) != 1 ||
+		   memcmp(hdr.magic, COMM_REC_MAGIC, sizeof(hdr.magic)))
+			FAIL("ERROR: '%s' is not a token log\n", desc->file);
+		if(hdr.tsize != ch->tsize)
+			FAIL("ERROR: '%s' holds %u byte tokens, channel needs %u\n",
+				desc->file, hdr.tsize, ch->tsize);
+		r->stamps = !!(hdr.flags & COMM_FLAG_RECORD_TIME);
+		r->timed  = !!(desc->flags & COMM_HOST_TIMED);
+		if(r->timed && !r->stamps)
+			FAIL("ERROR: '%s' has no timestamps for timed replay\n",
+				desc->file);
+		desc->log = r;
+	}
 
-		/* read metadata, calculate number of tokens to read */
-		SHM_READ(&meta, shmoff, sizeof(meta),
-			"rd: shm-read meta\n");
-		int level = (tnum + meta.wp - meta.rp) % tnum;
+	/* nanoseconds until the current record is due, 0 if it is */
+	static uint64_t replay_wait(comm_ctype_host_dsc_t *desc)
+	{
+		replay_t *r = desc->log;
 
-		/* read tokens from shm and write them to file */
-		uint8_t *token = malloc(ch->tsize);
-		for(int i = 0; i < level; i++) {
-			off_t offset = shmoff +
-				sizeof(comm_chost_shm_t) +
-				((meta.rp + i) % tnum) * ch->tsize;
+		if(!r || !r->timed || !r->left)
+			return(0);
+		uint64_t due = r->start + (r->stamp - r->first);
+		uint64_t now = host_now();
+		return((due > now) ? due - now : 0);
+	}
 
-			SHM_READ(token, offset, ch->tsize,
-				"rd: shm-read token\n");
+	/* fill up to 'space' tokens at 'wp' from the log, stopping at
+	   records not due yet; returns tokens written */
+	static int fill_replay(comm_channel_t *ch, void* param,
+		off_t data, int wp, int space)
+	{
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+		replay_t *r     = desc->log;
+		int      tnum   = ch->tnum + 1;
+		int      chunk  = host_chunk(ch);
+		int      tokens = 0;
 
-			if(write(desc->fd, token,
-				ch->tsize) != ch->tsize)
-					FAIL("rd: file-write token\n");
+		while(tokens < space) {
+			/* next record */
+			if(r->left == 0) {
+				comm_rec_t rec;
+				if(fread(&rec, sizeof(rec), 1, r->file) != 1 ||
+				   (r->stamps && fread(&r->stamp,
+				    sizeof(r->stamp), 1, r->file) != 1)) {
+					desc->eof = 1;
+					break;
+				}
+				if(rec.index != r->next)
+					PRINTF("WARNING: '%s' skips from token %llu "
+						"to %llu.\n", desc->file,
+						(unsigned long long)r->next,
+						(unsigned long long)rec.index);
+				if(!r->start) {
+					r->first = r->stamp;
+					r->start = host_now();
+				}
+				r->left = rec.count;
+				r->next = rec.index + rec.count;
+			}
+			if(replay_wait(desc))
+				break;
 
-			desc->count++;
+			/* move tokens */
+			int n = space - tokens;
+			if(n > (int)r->left) n = r->left;
+			if(n > chunk)        n = chunk;
+			if(fread(r->buf, ch->tsize, n, r->file) != (size_t)n) {
+				PRINTF("WARNING: '%s' is truncated.\n", desc->file);
+				r->left   = 0;
+				desc->eof = 1;
+				break;
+			}
+			ring_put(ch, param, data, (wp + tokens) % tnum, r->buf, n);
+			r->left -= n;
+			tokens  += n;
 		}
-		free(token);
-
-		/* update metadata (rp field only) */
-		int32_t newrp = (meta.rp + level) % tnum;
-		off_t offset = shmoff + offsetof(comm_chost_shm_t, rp);
-		SHM_WRITE(&newrp, offset, sizeof(newrp),
-			"rd: shm-write meta\n");
-		PRINTF("rd: (%2d/%2d | %lld) ", newrp, meta.wp, desc->count);
 
-		/* return number of tokens read for this channel */
-		return(desc->count);
+		return(tokens);
 	}
 
 	/* write to a channel */
 	static int do_write(comm_channel_t *ch, void* param)
 	{
-		off_t shmoff = (off_t)ch->src.dptr;
-		comm_ctype_host_dsc_t *desc =
-			(comm_ctype_host_dsc_t*)ch->src.hptr;
+		off_t shmoff = (off_t)ch->src.dptr.off;
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
 		comm_chost_shm_t      meta;	/* metadata: rp, wp */
 
 		#ifdef COMM_EPIPHANY
@@ -173,62 +1399,663 @@ int comm_host_init(comm_channel_t channels[COMM_NUM_CHANNELS])
 			"wr: shm-read meta\n");
 		int space = (tnum - 1 + meta.rp - meta.wp) % tnum;
 
-		/* read tokens from file and write them to shm */
-		uint8_t *token = malloc(ch->tsize);
-		for(int i = 0; i < space; i++) {
-			ssize_t ret;
+		/* fill free space, from text, log, mapping, read-ahead, stream
+		   or file; publish each chunk as soon as it landed */
+		off_t   data   = shmoff + sizeof(comm_chost_shm_t);
+		off_t   offset = shmoff + offsetof(comm_chost_shm_t, wp);
+		int32_t newwp  = meta.wp;
+		int     chunk  = host_chunk(ch);
+		for(int done = 0; done < space; ) {
+			int n = (space - done < chunk) ? space - done : chunk;
+			int tokens = desc->text ?
+				fill_text  (ch, param, data, newwp, n) :
+				desc->log  ?
+				fill_replay(ch, param, data, newwp, n) :
+				desc->map  ?
+				fill_mmap  (ch, param, data, newwp, n) :
+				desc->priv ?
+				fill_aio   (ch, param, data, newwp, n) :
+				(desc->flags & COMM_HOST_STREAM) ?
+				fill_stream(ch, param, data, newwp, n) :
+				fill_file  (ch, param, data, newwp, n);
+			desc->count += tokens;
+			done        += tokens;
 
-			ret = read(desc->fd, token, ch->tsize);
-			if(ret == 0) {
-				break;	/* eof */
-			} else if(ret != ch->tsize) {
-				FAIL("wr: file-read token: %s (%i)\n",
-					strerror(errno), ret);
+			/* update metadata (wp field only) */
+			newwp = (newwp + tokens) % tnum;
+			SHM_WRITE(&newwp, offset, sizeof(newwp),
+				"wr: shm-write meta\n");
+			if(tokens < n)
+				break;	/* source dry */
+		}
+		/* source exhausted, all of it published: end the stream */
+		if(desc->eof && !meta.eos) {
+			int32_t eos = 1;
+		#ifdef COMM_PTHREAD
+			__sync_synchronize();
+		#endif
+			SHM_WRITE(&eos, shmoff + offsetof(comm_chost_shm_t, eos),
+				sizeof(eos), "wr: shm-write meta\n");
+		}
+		STATUS("wr: (%2d/%2d | %llu) ", meta.rp, newwp,
+			(unsigned long long)desc->count);
+
+		/* return number of tokens written for this channel */
+		return(desc->count);
+	}
+
+	/* one service pass over the channels of 'svc' */
+	static void svc_handle(host_svc_t *svc, comm_channel_t *channels,
+		void* param)
+	{
+		svc->load = 0;
+		for(int i = 0; i < svc->num; i++) {
+			comm_channel_t *ch = &channels[svc->list[i]];
+			comm_ctype_host_dsc_t *desc;
+			uint64_t before;
+
+			/* do_read, do_write will print status */
+			if(ch->dst.core == -1) {
+				desc   = ch->dst.hptr.ptr;
+				before = desc->count;
+				do_read(ch, param);
+			} else {
+				desc   = ch->src.hptr.ptr;
+				before = desc->count;
+				do_write(ch, param);
 			}
 
-			off_t offset = shmoff +
-				sizeof(comm_chost_shm_t) +
-				((meta.wp + i) % tnum) * ch->tsize;
-			SHM_WRITE(token, offset, ch->tsize,
-				"wr: shm-write token\n");
+			/* track busiest ring for svc_wait() */
+			int load = (desc->count - before) * 100 / ch->tnum;
+			if(load > svc->load)
+				svc->load = load;
+		}
+	}
+
+#ifdef COMM_PTHREAD
+	/* shared structure of a host channel */
+	static volatile comm_chost_shm_t* host_shm(comm_channel_t *ch,
+		void* param)
+	{
+		uint64_t off = (ch->dst.core == -1) ?
+			ch->dst.dptr.off : ch->src.dptr.off;
+		return((void*)((uint8_t*)param + off));
+	}
+
+	/* true if svc_handle() could move tokens on 'ch' */
+	static int host_pending(comm_channel_t *ch, void* param)
+	{
+		volatile comm_chost_shm_t *meta = host_shm(ch, param);
+		int tnum  = ch->tnum + 1;
+		int level = (tnum + meta->wp - meta->rp) % tnum;
 
-			desc->count++;
+		if(ch->dst.core == -1) {
+			comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+			aio_t *aio = desc->priv;
+			if(desc->flags & COMM_HOST_SPLICE)
+				return((uint64_t)level * ch->tsize > desc->held);
+			return(level > 0 && (!aio ||
+				aio_state(aio, &aio->chunk[aio->cur]) == AIO_FREE));
+		} else {
+			comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+			aio_t *aio = desc->priv;
+			/* streams are polled by svc_wait(), but converted
+			   text may be left over from the last pass */
+			if(desc->flags & COMM_HOST_STREAM)
+				return(level < tnum - 1 && desc->text &&
+					((text_t*)desc->text)->ready);
+			return(level < tnum - 1 && !desc->eof &&
+				!replay_wait(desc) && (!aio ||
+				aio_state(aio, &aio->chunk[aio->cur]) == AIO_READY));
 		}
-		free(token);
+	}
 
-		/* update metadata (wp field only) */
-		int32_t newwp = (meta.wp + space) % tnum;
-		off_t offset = shmoff + offsetof(comm_chost_shm_t, wp);
-		SHM_WRITE(&newwp, offset, sizeof(newwp),
-			"wr: shm-write meta\n");
-		PRINTF("wr: (%2d/%2d | %lld) ", meta.rp, newwp, desc->count);
+	/* input stream with room in its ring, or -1 */
+	static int host_stream_fd(comm_channel_t *ch, void* param)
+	{
+		if(ch->src.core != -1)
+			return(-1);
 
-		/* return number of tokens written for this channel */
-		return(desc->count);
+		comm_ctype_host_dsc_t *desc = ch->src.hptr.ptr;
+		if(!(desc->flags & COMM_HOST_STREAM) || desc->eof)
+			return(-1);
+
+		volatile comm_chost_shm_t *meta = host_shm(ch, param);
+		int tnum  = ch->tnum + 1;
+		int space = (tnum - 1 + meta->rp - meta->wp) % tnum;
+		return((space > 0) ? desc->fd : -1);
+	}
+#endif /* COMM_PTHREAD */
+
+	/* microseconds until the next timed replay record of 'svc' is due,
+	   at most 'us' */
+	static useconds_t svc_due(host_svc_t *svc, comm_channel_t *channels,
+		useconds_t us)
+	{
+		for(int i = 0; i < svc->num; i++) {
+			comm_channel_t *ch = &channels[svc->list[i]];
+			if(ch->src.core != -1)
+				continue;
+
+			uint64_t ns = replay_wait(ch->src.hptr.ptr);
+			if(ns && (ns + 999) / 1000 < us)
+				us = (ns + 999) / 1000;
+		}
+		return(us);
+	}
+
+	/* sleep until channels of 'svc' need service;
+	   pthreads: cores ring an eventfd once half a ring can be moved,
+	   epiphany: poll interval adapts to the observed ring load */
+	static void svc_wait(host_svc_t *svc, comm_channel_t *channels,
+		void* param)
+	{
+	#ifdef COMM_PTHREAD
+		int pending = 0;
+
+		/* ask cores for a wakeup, then check for work once more */
+		for(int i = 0; i < svc->num; i++) {
+			comm_channel_t *ch = &channels[svc->list[i]];
+			volatile comm_chost_shm_t *meta = host_shm(ch, param);
+			meta->efd  = svc->efd;
+			meta->wait = (ch->tnum + 1) / 2;
+		}
+		__sync_synchronize();
+		for(int i = 0; i < svc->num && !pending; i++)
+			pending = host_pending(&channels[svc->list[i]], param);
+
+		if(!pending) {
+			/* doorbell, and streams that can be read */
+			struct pollfd pfd[1 + COMM_NUM_CHANNELS];
+			int nfd  = 0;
+			int held = 0;
+			pfd[nfd++] = (struct pollfd){ svc->efd, POLLIN, 0 };
+			for(int i = 0; i < svc->num; i++) {
+				comm_channel_t *ch = &channels[svc->list[i]];
+				int fd = host_stream_fd(ch, param);
+				if(fd != -1)
+					pfd[nfd++] = (struct pollfd){ fd, POLLIN, 0 };
+				if(ch->dst.core == -1 && ((comm_ctype_host_dsc_t*)
+				   ch->dst.hptr.ptr)->held)
+					held = 1;
+			}
+
+			/* pipes don't signal their readers' progress:
+			   check back soon if spliced tokens are pending */
+			useconds_t us = held ? COMM_CFG_HOST_MINWAIT :
+				COMM_CFG_HOST_MAXWAIT;
+			us = svc_due(svc, channels, us);
+			struct timespec ts = { us / 1000000, (us % 1000000) * 1000 };
+			ppoll(pfd, nfd, &ts, NULL);
+		}
+
+		/* reset doorbell and requests */
+		uint64_t cnt;
+		if(read(svc->efd, &cnt, sizeof(cnt)) < 0)
+			;	/* not rung */
+		for(int i = 0; i < svc->num; i++)
+			host_shm(&channels[svc->list[i]], param)->wait = 0;
+	#else
+		/* rings filling up fast: poll more often, and vice versa */
+		if(svc->load > 50)
+			svc->interval /= 2;
+		else if(svc->load < 12)
+			svc->interval *= 2;
+
+		if(svc->interval < COMM_CFG_HOST_MINWAIT)
+			svc->interval = COMM_CFG_HOST_MINWAIT;
+		if(svc->interval > COMM_CFG_HOST_MAXWAIT)
+			svc->interval = COMM_CFG_HOST_MAXWAIT;
+		usleep(svc_due(svc, channels, svc->interval));
+	#endif
+	}
+
+	/* prepare a service, doorbell on pthreads */
+	static void svc_init(host_svc_t *svc)
+	{
+		svc->num      = 0;
+		svc->interval = COMM_CFG_HOST_MAXWAIT;
+		svc->cpu      = -1;
+	#ifdef COMM_PTHREAD
+		svc->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(svc->efd == -1)
+			FAIL("ERROR: can't create eventfd: %s\n", strerror(errno));
+	#endif
+	}
+
+	/* worker thread: serve own channels until comm_host_flush() */
+	static void* svc_thread(void *arg)
+	{
+		host_svc_t *svc = arg;
+
+		host_quiet = 1;
+		while(!host_stop) {
+			svc_handle(svc, svc->channels, svc->param);
+			svc_wait  (svc, svc->channels, svc->param);
+		}
+
+		return(NULL);
 	}
 
-	/* handle all channels */
+	/* handle host channels not served by workers */
 	void comm_host_handle(comm_channel_t channels[COMM_NUM_CHANNELS],
 		void* param)
 	{
+		if(!param)
+			FAIL("comm_host_handle: missing param!\n");
+
 		PRINTF("commlib-host: ");
-		for(size_t i = 0; i < COMM_NUM_CHANNELS; i++) {
-			if(channels[i].type != COMM_CTYPE_HOST)
+		svc_handle(&host_main, channels, param);
+
+		/* progress of workers */
+		for(int w = 0; w < host_workers; w++) {
+			for(int i = 0; i < host_worker[w].num; i++) {
+				comm_channel_t *ch =
+					&channels[host_worker[w].list[i]];
+				int out = (ch->dst.core == -1);
+				comm_ctype_host_dsc_t *desc = out ?
+					ch->dst.hptr.ptr : ch->src.hptr.ptr;
+				PRINTF("%s: (%llu) ", out ? "rd" : "wr",
+					(unsigned long long)desc->count);
+			}
+		}
+		PRINTF("\r"); fflush(NULL);
+	}
+
+	/* sleep until host channels not served by workers need service */
+	void comm_host_wait(comm_channel_t channels[],
+		void* param)
+	{
+		svc_wait(&host_main, channels, param);
+	}
+
+	/* true once the cores closed all host output channels and these
+	   are drained, false if there are none */
+	int comm_host_done(comm_channel_t channels[])
+	{
+		int outputs = 0;
+
+		for(int i = 0; i < COMM_NUM_CHANNELS; i++) {
+			comm_channel_t *ch = &channels[i];
+			if(ch->type != COMM_CTYPE_HOST || ch->dst.core != -1)
 				continue;
+			if(!((comm_ctype_host_dsc_t*)ch->dst.hptr.ptr)->eof)
+				return(0);
+			outputs++;
+		}
+		return(outputs > 0);
+	}
+
+	/* hand host channels to up to COMM_CFG_HOST_WORKERS threads,
+	   round-robin; a worker is pinned to the cpu given for its first
+	   channel, if 'cpus' maps channels to cpus (-1: not pinned) */
+	void comm_host_start(comm_channel_t channels[],
+		void* param, const int cpus[])
+	{
+		int n = (host_main.num < COMM_CFG_HOST_WORKERS) ?
+			host_main.num : COMM_CFG_HOST_WORKERS;
+		if(n == 0)
+			return;
+
+		for(int w = 0; w < n; w++) {
+			host_worker[w].channels = channels;
+			host_worker[w].param    = param;
+		}
+		for(int i = 0; i < host_main.num; i++) {
+			host_svc_t     *svc = &host_worker[i % n];
+			comm_channel_t *ch  = &channels[host_main.list[i]];
+			comm_ctype_host_dsc_t *desc = (ch->dst.core == -1) ?
+				ch->dst.hptr.ptr : ch->src.hptr.ptr;
 
-			if(!param)
-				FAIL("comm_host_handle: missing param!\n");
+			if(svc->num == 0 && cpus)
+				svc->cpu = cpus[host_main.list[i]];
+			svc->list[svc->num++] = host_main.list[i];
 
-			/* do_read, do_write will print status */
-			if(channels[i].dst.core == -1) {
-				do_read(&channels[i], param);
-			} else if(channels[i].src.core == -1) {
-				do_write(&channels[i], param);
+			/* background I/O now wakes the worker */
+			if(desc->priv)
+				aio_wakes(desc->priv, svc->efd);
+		}
+		host_main.num = 0;
+
+		host_stop = 0;
+		for(int w = 0; w < n; w++) {
+			host_svc_t *svc = &host_worker[w];
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			if(svc->cpu >= 0) {
+				cpu_set_t set;
+				CPU_ZERO(&set);
+				CPU_SET(svc->cpu, &set);
+				pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+			}
+			if(pthread_create(&svc->thread, &attr, svc_thread, svc))
+				FAIL("ERROR: can't create host worker\n");
+			pthread_attr_destroy(&attr);
+			PRINTF("Host worker %2d: %d channel(s), cpu %2d\n",
+				w, svc->num, svc->cpu);
+		}
+		host_workers = n;
+	}
+
+	/* stop workers, hand their channels back to the main loop */
+	static void svc_stop(void)
+	{
+		host_stop = 1;
+		for(int w = 0; w < host_workers; w++)
+			host_wake(host_worker[w].efd);
+
+		for(int w = 0; w < host_workers; w++) {
+			host_svc_t *svc = &host_worker[w];
+			pthread_join(svc->thread, NULL);
+
+			for(int i = 0; i < svc->num; i++) {
+				comm_channel_t *ch = &svc->channels[svc->list[i]];
+				comm_ctype_host_dsc_t *desc = (ch->dst.core == -1) ?
+					ch->dst.hptr.ptr : ch->src.hptr.ptr;
+				if(desc->priv)
+					aio_wakes(desc->priv, host_main.efd);
+				host_main.list[host_main.num++] = svc->list[i];
+			}
+			svc->num = 0;
+		}
+		host_workers = 0;
+	}
+
+	/* drain all host output channels completely */
+	void comm_host_flush(comm_channel_t channels[],
+		void* param)
+	{
+		uint64_t before, after;
+
+		svc_stop();
+		host_final = 1;
+		do {
+			aio_flush();
+
+			before = after = 0;
+			for(int i = 0; i < host_main.num; i++) {
+				comm_channel_t *ch = &channels[host_main.list[i]];
+				if(ch->dst.core != -1)
+					continue;
+
+				comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+				before += desc->count;
+				do_read(ch, param);
+				after  += desc->count;
 			}
+		} while(after != before);
+
+		for(int i = 0; i < host_main.num; i++) {
+			comm_channel_t *ch = &channels[host_main.list[i]];
+			comm_ctype_host_dsc_t *desc = ch->dst.hptr.ptr;
+			if(ch->dst.core != -1)
+				continue;
+			drain_cbuf(desc);
+			if(desc->text)
+				text_flush(desc);
+			if(desc->map)
+				unmap_output(ch, desc);
+			if(desc->priv)
+				aio_tail(desc);
 		}
+		aio_flush();
 		PRINTF("\r"); fflush(NULL);
 	}
+
+	/* after comm_host_flush(), while cores move no tokens: close the
+	   files of all host channels, release their buffers and empty the
+	   rings. comm_host_init() opens them again, under the names in the
+	   descriptors, for the next stream */
+	void comm_host_close(comm_channel_t channels[],
+		void* param)
+	{
+		#ifdef COMM_EPIPHANY
+			e_mem_t *emem = param;
+		#endif
+
+		#ifdef COMM_PTHREAD
+			void* shmbase = param;
+		#endif
+
+		for(int i = 0; i < host_main.num; i++) {
+			comm_channel_t *ch = &channels[host_main.list[i]];
+			int source = (ch->src.core == -1);
+			comm_ctype_host_dsc_t *desc = source ?
+				ch->src.hptr.ptr : ch->dst.hptr.ptr;
+			off_t shmoff = source ?
+				(off_t)ch->src.dptr.off : (off_t)ch->dst.dptr.off;
+
+			/* buffers and state of the stream */
+			if(desc->priv)
+				aio_release(desc);
+			if(desc->text) {
+				free(((text_t*)desc->text)->txt);
+				free(((text_t*)desc->text)->bin);
+				free(desc->text);
+				desc->text = NULL;
+			}
+			if(desc->log) {
+				fclose(((replay_t*)desc->log)->file);	/* and fd */
+				free(((replay_t*)desc->log)->buf);
+				free(desc->log);
+				desc->log = NULL;
+				desc->fd  = -1;
+			}
+			if(desc->map)
+				munmap(desc->map, desc->size);
+			free(desc->cbuf);
+			free(desc->part);
+			free(desc->buf);
+			desc->map   = NULL;
+			desc->size  = 0;
+			desc->cbuf  = NULL;
+			desc->cfill = 0;
+			desc->part  = NULL;
+			desc->plen  = 0;
+			desc->buf   = NULL;
+			desc->held  = 0;
+			desc->count = 0;
+			desc->eof   = 0;
+
+		#ifdef COMM_PTHREAD
+			/* spliced output: the pipe still references the ring,
+			   which the next stream writes again */
+			if(desc->flags & COMM_HOST_SPLICE) {
+				int queued;
+				while(!ioctl(desc->fd, FIONREAD, &queued) &&
+				      queued > 0)
+					usleep(COMM_CFG_HOST_MINWAIT);
+			}
+		#endif
+
+			/* file, kinds are found again by comm_host_init() */
+			if(desc->fd > 2)
+				close(desc->fd);
+			desc->fd     = -1;
+			desc->flags &= ~(COMM_HOST_STREAM | COMM_HOST_SPLICE);
+
+			/* empty ring, open stream */
+			comm_chost_shm_t meta;
+			SHM_READ(&meta, shmoff, sizeof(meta),
+				"close: shm-read meta\n");
+			meta.rp   = 0;
+			meta.wp   = 0;
+			meta.wait = 0;
+			meta.eos  = 0;
+			SHM_WRITE(&meta, shmoff, sizeof(meta),
+				"close: shm-write meta\n");
+		}
+		host_main.num = 0;
+		host_final    = 0;
+	}
+#endif /* COMM_CFG_CTYPE_HOST */
+
+/* initialize commlib-host */
+int comm_host_init(comm_channel_t channels[COMM_NUM_CHANNELS])
+{
+#ifdef COMM_CFG_CTYPE_HOST
+	/* doorbells exist before any core starts, core processes
+	   (COMM_PROCESS) inherit them; once, streams after
+	   comm_host_close() reuse them */
+	static int svcs = 0;
+	if(!svcs) {
+		svc_init(&host_main);
+		for(int w = 0; w < COMM_CFG_HOST_WORKERS; w++)
+			svc_init(&host_worker[w]);
+		svcs = 1;
+	}
+#endif
+
+	for(size_t i = 0; i < COMM_NUM_CHANNELS; i++) {
+#ifdef COMM_CFG_CTYPE_HOST
+		if(channels[i].type == COMM_CTYPE_HOST) {
+			int source;	/* direction, 1 if host -> device */
+			comm_ctype_host_dsc_t *desc;
+
+			/* grab descriptor for channel */
+			if(channels[i].src.core == -1) {
+				source = 1;
+				desc   = channels[i].src.hptr.ptr;
+			} else if(channels[i].dst.core == -1) {
+				source = 0;
+				desc   = channels[i].dst.hptr.ptr;
+			} else {
+				FAIL("ERROR: host channel %2zu invalid\n", i);
+			}
+
+			/* no file yet (server between jobs): left closed */
+			if(!desc->file)
+				continue;
+			host_main.list[host_main.num++] = i;
+
+			/* format adapters and logs work on plain reads and
+			   writes */
+			if((desc->codec || (desc->flags & COMM_HOST_REPLAY)) &&
+			   (desc->flags & (COMM_HOST_MMAP |
+			   COMM_HOST_ASYNC | COMM_HOST_DIRECT))) {
+				PRINTF("WARNING: '%s' is converted, ignoring "
+					"mapping and background I/O.\n", desc->file);
+				desc->flags &= ~(COMM_HOST_MMAP |
+					COMM_HOST_ASYNC | COMM_HOST_DIRECT);
+			}
+
+			/* open file if necessary */
+			int direct = (desc->flags & COMM_HOST_DIRECT) ? O_DIRECT : 0;
+			while(desc->fd == -1) {
+				if(source) {
+					/* handle magic name "stdin" */
+					if(!strcmp(desc->file, "stdin")) {
+						desc->fd = 0;
+					} else {
+						desc->fd = open(desc->file,
+							O_RDONLY | direct);
+					}
+				} else {
+					/* handle magic name "stdout" */
+					if(!strcmp(desc->file, "stdout")) {
+						desc->fd = 1;
+					} else {
+						desc->fd = open(desc->file,
+							((desc->flags &
+							  COMM_HOST_MMAP) ?
+							 O_RDWR : O_WRONLY) |
+							O_CREAT | O_TRUNC |
+							direct, 0666);
+					}
+				}
+
+				/* no direct I/O on this file system: retry */
+				if(desc->fd == -1 && errno == EINVAL && direct) {
+					PRINTF("WARNING: no direct I/O for '%s'.\n",
+						desc->file);
+					desc->flags &= ~COMM_HOST_DIRECT;
+					direct = 0;
+					continue;
+				}
+
+				/* fail on error */
+				if(desc->fd == -1) {
+					FAIL("ERROR: can't open '%s': %s\n",
+						desc->file, strerror(errno));
+				}
+			}
+
+			/* pipes, FIFOs, terminals: read without blocking
+			   (stream_read()) */
+			struct stat st;
+			if(source && !(desc->flags & COMM_HOST_REPLAY) &&
+			   !fstat(desc->fd, &st) && !S_ISREG(st.st_mode))
+				desc->flags |= COMM_HOST_STREAM;
+			if(source && (desc->flags & COMM_HOST_STREAM)) {
+				desc->part = malloc(channels[i].tsize);
+				if(!desc->part)
+					FAIL("ERROR: can't allocate token buffer\n");
+			}
+
+			/* output pipes: splice from the ring (pthreads),
+			   output files: coalesce small writes */
+			if(!source && !desc->codec && !fstat(desc->fd, &st)) {
+			#ifdef COMM_PTHREAD
+				if(S_ISFIFO(st.st_mode))
+					desc->flags |= COMM_HOST_SPLICE;
+			#endif
+				if(S_ISREG(st.st_mode) && COMM_CFG_HOST_COALESCE &&
+				   !(desc->flags & (COMM_HOST_ASYNC |
+				     COMM_HOST_MMAP | COMM_HOST_DIRECT))) {
+					desc->cbuf = malloc(COMM_CFG_HOST_COALESCE);
+					if(!desc->cbuf)
+						FAIL("ERROR: can't allocate "
+							"coalescing buffer\n");
+				}
+			}
+
+			/* map input or output file, if requested */
+			if(source && !(desc->flags & COMM_HOST_STREAM) &&
+			   (desc->flags & COMM_HOST_MMAP))
+				map_input(&channels[i], desc);
+			if(!source && (desc->flags & COMM_HOST_MMAP))
+				map_output(desc);
+
+			/* background file I/O, if requested;
+			   plain input files are always read ahead. It works
+			   at file offsets: regular files only, the others
+			   are read and written in place */
+			if(!desc->codec && !desc->map &&
+			   !fstat(desc->fd, &st) && S_ISREG(st.st_mode) &&
+			   !(desc->flags & COMM_HOST_REPLAY) &&
+			   !(desc->flags & (COMM_HOST_STREAM | COMM_HOST_SPLICE)) &&
+			   ((desc->flags & (COMM_HOST_ASYNC | COMM_HOST_DIRECT)) ||
+			    (source && COMM_CFG_HOST_READAHEAD > 0)))
+				aio_setup(&channels[i], desc, source);
+
+			/* conversion buffers, log reader */
+			if(desc->codec)
+				text_setup(&channels[i], desc);
+			else if(source && (desc->flags & COMM_HOST_REPLAY))
+				replay_setup(&channels[i], desc);
+
+#ifdef COMM_EPIPHANY
+			/* staging buffer, holds a full ring */
+			desc->buf = malloc(channels[i].tsize * channels[i].tnum);
+			if(!desc->buf)
+				FAIL("ERROR: can't allocate staging buffer\n");
+#endif
+
+			PRINTF("Host channel %2zu: fd %2i, %s %s '%s'.\n",
+				i, desc->fd,
+				source ? " input" : "output",
+				desc->codec ? desc->codec->name :
+				desc->log   ? "replay" :
+				(desc->flags & COMM_HOST_STREAM) ? "stream" :
+				(desc->flags & COMM_HOST_SPLICE) ? "pipe"   : "file",
+				desc->file);
+
+		}
 #endif /* COMM_CFG_CTYPE_HOST */
+	}
+
+	return(0);
+}
 
 /* dump channel structure */
 void comm_host_dump(comm_channel_t channels[COMM_NUM_CHANNELS])
@@ -239,41 +2066,55 @@ void comm_host_dump(comm_channel_t channels[COMM_NUM_CHANNELS])
 #ifdef COMM_CFG_CTYPE_DEFAULT
 		case COMM_CTYPE_DEFAULT:
 			PRINTF("DEFAULT [%2zu]: %5d * %2d bytes  |  "
-				"[0x%8x] [0x%8x]  |  %2d -> %2d\n",
+				"[0x%8llx] [0x%8llx]  |  %2d -> %2d\n",
 				i,
 				channels[i].tnum, channels[i].tsize,
-				(uint32_t)channels[i].src.dptr,
-				(uint32_t)channels[i].dst.dptr,
+				(unsigned long long)channels[i].src.dptr.off,
+				(unsigned long long)channels[i].dst.dptr.off,
 				channels[i].src.core, channels[i].dst.core);
 			break;
 #endif /* COMM_CFG_CTYPE_DEFAULT */
 #ifdef COMM_CFG_CTYPE_HOST
 		case COMM_CTYPE_HOST:
 			if(channels[i].src.core == -1) {
+				comm_ctype_host_dsc_t *desc =
+					channels[i].src.hptr.ptr;
 				PRINTF("HOST    [%2zu]: %5d * %2d bytes  |  "
-					"[0x%8x]  |  '%s' (fd %d @ %d) -> %2d\n",
+					"[0x%8llx]  |  '%s' (fd %d @ %llu) -> %2d\n",
 					i,
 					channels[i].tnum, channels[i].tsize,
-					(uint32_t)channels[i].dst.dptr,
-					((comm_ctype_host_dsc_t*)channels[i].src.hptr)->file,
-					((comm_ctype_host_dsc_t*)channels[i].src.hptr)->fd,
-					(uint32_t)channels[i].src.dptr,
+					(unsigned long long)channels[i].dst.dptr.off,
+					desc->file, desc->fd,
+					(unsigned long long)channels[i].src.dptr.off,
 					channels[i].dst.core);
 			} else if(channels[i].dst.core == -1) {
+				comm_ctype_host_dsc_t *desc =
+					channels[i].dst.hptr.ptr;
 				PRINTF("HOST    [%2zu]: %5d * %2d bytes  |  "
-					"[0x%8x]  |  %2d -> '%s' (fd %d @ %d)\n",
+					"[0x%8llx]  |  %2d -> '%s' (fd %d @ %llu)\n",
 					i,
 					channels[i].tnum, channels[i].tsize,
-					(uint32_t)channels[i].src.dptr,
+					(unsigned long long)channels[i].src.dptr.off,
 					channels[i].src.core,
-					((comm_ctype_host_dsc_t*)channels[i].dst.hptr)->file,
-					((comm_ctype_host_dsc_t*)channels[i].dst.hptr)->fd,
-					(uint32_t)channels[i].dst.dptr);
+					desc->file, desc->fd,
+					(unsigned long long)channels[i].dst.dptr.off);
 			} else {
 				PRINTF("HOST    [%2zu]: invalid configuration", i);
 			}
 			break;
 #endif /* COMM_CFG_CTYPE_HOST */
+#ifdef COMM_CFG_CTYPE_SOCKET
+		case COMM_CTYPE_SOCKET: {
+			comm_ctype_socket_dsc_t *desc = channels[i].dst.hptr.ptr;
+			PRINTF("SOCKET  [%2zu]: %5d * %2d bytes  |  "
+				"'%s'  |  %2d -> %2d\n",
+				i,
+				channels[i].tnum, channels[i].tsize,
+				desc->addr,
+				channels[i].src.core, channels[i].dst.core);
+			break;
+		}
+#endif /* COMM_CFG_CTYPE_SOCKET */
 		default:
 			PRINTF("UNKNOWN [%2zu]: invalid channel type %d\n",
 				i, channels[i].type);
@@ -0,0 +1,381 @@
+/* Copyright (c) 2015 S.Raase. All rights reserved. */
+
+/* Communication Library Source (Host), M:N actor scheduler */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../commlib.h"
+
+#define FAIL(...)   do { fprintf(stderr, __VA_ARGS__); exit(1); } while(0)
+#define PRINTF(...) do { fprintf(stderr, __VA_ARGS__);          } while(0);
+
+#ifdef COMM_PTHREAD
+	/* actor states; an actor is in at most one deque, owned by the
+	   worker that moved it out of ACTOR_IDLE */
+	enum {
+		ACTOR_IDLE = 0,	/* waiting for tokens or room */
+		ACTOR_CHECK,	/* readiness being checked */
+		ACTOR_QUEUED,	/* in a deque */
+		ACTOR_RUNNING,	/* firing on a worker */
+		ACTOR_DONE,	/* fire function returned non-zero */
+	};
+
+	typedef struct {
+		comm_actor_t  *def;
+		comm_handle_t in[COMM_ACTOR_PORTS];
+		comm_handle_t out[COMM_ACTOR_PORTS];
+		int           down[COMM_ACTOR_PORTS];	/* drains out[], or -1 */
+		int           next[2 * COMM_ACTOR_PORTS];	/* neighbours */
+		int           nnext;
+		volatile int  state;
+		volatile int  poke;	/* state changed during a check */
+	} actor_t;
+
+	/* per worker: deque of actor indices, the owner works at the
+	   bottom (LIFO, warm caches), thieves take from the top */
+	typedef struct {
+		pthread_spinlock_t lock;
+		int *slot;
+		int top, bot;	/* slot[i % nactors], top <= bot */
+		uint32_t seed;	/* victim selection */
+	} deque_t;
+
+	typedef struct {
+		actor_t         *actor;
+		int             nactors;
+		deque_t         *deque;
+		int             nworkers;
+		volatile int    done;	/* actors done */
+		volatile int    sleepers;
+		pthread_mutex_t mutex;
+		pthread_cond_t  cond;
+	} sched_t;
+
+	/* push to the bottom of an owned deque, never full: every actor
+	   is in one deque at most */
+	static void deque_push(sched_t *s, deque_t *d, int a)
+	{
+		pthread_spin_lock(&d->lock);
+		d->slot[d->bot++ % s->nactors] = a;
+		pthread_spin_unlock(&d->lock);
+	}
+
+	/* pop from the bottom (owner) or the top (thief), -1 if empty */
+	static int deque_pop(sched_t *s, deque_t *d, int steal)
+	{
+		int a = -1;
+
+		pthread_spin_lock(&d->lock);
+		if(d->top != d->bot)
+			a = steal ? d->slot[d->top++ % s->nactors] :
+				d->slot[--d->bot % s->nactors];
+		if(d->top >= s->nactors) {	/* keep indices small */
+			d->top -= s->nactors;
+			d->bot -= s->nactors;
+		}
+		pthread_spin_unlock(&d->lock);
+		return(a);
+	}
+
+	/* true if the actor can fire without blocking; an input closed by
+	   its writer won't block either, it returns what is left */
+	static int actor_ready(actor_t *a)
+	{
+		comm_actor_t *def = a->def;
+
+		for(int i = 0; i < def->nin; i++) {
+			int level = comm_level(a->in[i]);
+			if(level != COMM_EOS && level < def->in[i].rate &&
+			   !comm_closed(a->in[i]))
+				return(0);
+		}
+		for(int i = 0; i < def->nout; i++)
+			if(comm_space(a->out[i]) < def->out[i].rate)
+				return(0);
+		return(1);
+	}
+
+	/* true if an output lacks room and the actor draining it is done,
+	   so the room won't come */
+	static int actor_stuck(sched_t *s, actor_t *a)
+	{
+		comm_actor_t *def = a->def;
+
+		for(int i = 0; i < def->nout; i++)
+			if(a->down[i] != -1 &&
+			   s->actor[a->down[i]].state == ACTOR_DONE &&
+			   comm_space(a->out[i]) < def->out[i].rate)
+				return(1);
+		return(0);
+	}
+
+	/* queue actor 'n' on deque 'd' if it is idle and ready. A check
+	   that overlaps another is repeated by its owner (poke), so no
+	   change of tokens or room goes unseen */
+	static void actor_wake(sched_t *s, deque_t *d, int n)
+	{
+		actor_t *a = &s->actor[n];
+
+		for(;;) {
+			a->poke = 1;
+			__sync_synchronize();
+			if(!__sync_bool_compare_and_swap(&a->state, ACTOR_IDLE,
+				ACTOR_CHECK))
+					return;
+			a->poke = 0;
+			__sync_synchronize();
+
+			if(actor_ready(a)) {
+				a->state = ACTOR_QUEUED;
+				deque_push(s, d, n);
+
+				/* wake a sleeping worker to steal it */
+				if(s->sleepers) {
+					pthread_mutex_lock(&s->mutex);
+					pthread_cond_signal(&s->cond);
+					pthread_mutex_unlock(&s->mutex);
+				}
+				return;
+			}
+			if(actor_stuck(s, a)) {
+				/* retire it, its neighbours are
+				   checked by the idle scan */
+				a->state = ACTOR_DONE;
+				__sync_fetch_and_add(&s->done, 1);
+				return;
+			}
+
+			a->state = ACTOR_IDLE;
+			__sync_synchronize();
+			if(!a->poke)
+				return;
+		}
+	}
+
+	/* fire actor 'n' while ready, up to COMM_CFG_SCHED_BURST times,
+	   then requeue it and its neighbours if they became ready */
+	static void actor_run(sched_t *s, deque_t *d, int n)
+	{
+		actor_t *a = &s->actor[n];
+
+		a->state = ACTOR_RUNNING;
+		for(int i = 0; i < COMM_CFG_SCHED_BURST; i++) {
+			if(a->def->fire(a->in, a->out, a->def->arg)) {
+				a->state = ACTOR_DONE;
+				__sync_fetch_and_add(&s->done, 1);
+				break;
+			}
+			if(!actor_ready(a))
+				break;
+		}
+
+		if(a->state != ACTOR_DONE) {
+			__sync_synchronize();
+			a->state = ACTOR_IDLE;
+			actor_wake(s, d, n);
+		}
+		__sync_synchronize();
+		for(int i = 0; i < a->nnext; i++)
+			actor_wake(s, d, a->next[i]);
+	}
+
+	/* find work elsewhere: other deques, then idle actors fed from
+	   outside the pool (host channels, sockets); -1 if none */
+	static int worker_find(sched_t *s, deque_t *d)
+	{
+		for(int i = 1; i < s->nworkers; i++) {
+			d->seed = d->seed * 1103515245 + 12345;
+			deque_t *v = &s->deque[(d->seed >> 16) % s->nworkers];
+			int a;
+			if(v != d && (a = deque_pop(s, v, 1)) != -1)
+				return(a);
+		}
+
+		for(int i = 0; i < s->nactors; i++)
+			if(s->actor[i].state == ACTOR_IDLE)
+				actor_wake(s, d, i);
+		return(deque_pop(s, d, 0));
+	}
+
+	/* sleep until pushed work or the timeout */
+	static void worker_sleep(sched_t *s, int usec)
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += usec * 1000;
+		if(ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&s->mutex);
+		__sync_fetch_and_add(&s->sleepers, 1);
+		if(s->done < s->nactors)
+			pthread_cond_timedwait(&s->cond, &s->mutex, &ts);
+		__sync_fetch_and_sub(&s->sleepers, 1);
+		pthread_mutex_unlock(&s->mutex);
+	}
+
+	typedef struct {
+		sched_t *s;
+		int     id;
+	} worker_arg_t;
+
+	static void* worker(void *arg)
+	{
+		sched_t *s = ((worker_arg_t*)arg)->s;
+		deque_t *d = &s->deque[((worker_arg_t*)arg)->id];
+		int      wait = 1;
+
+		while(s->done < s->nactors) {
+			int a = deque_pop(s, d, 0);
+			if(a == -1)
+				a = worker_find(s, d);
+
+			if(a != -1) {
+				actor_run(s, d, a);
+				wait = 1;
+			} else {
+				/* back off, wake up on pushed work */
+				worker_sleep(s, wait);
+				if(wait < COMM_CFG_SCHED_MAXWAIT)
+					wait *= 2;
+			}
+		}
+
+		/* release other sleepers */
+		pthread_mutex_lock(&s->mutex);
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+		return(NULL);
+	}
+
+	/* add 'b' to the neighbours of 'a' */
+	static void actor_link(actor_t *a, int b)
+	{
+		for(int i = 0; i < a->nnext; i++)
+			if(a->next[i] == b)
+				return;
+		a->next[a->nnext++] = b;
+	}
+
+	int comm_sched_run(comm_channel_t channels[],
+		comm_actor_t actors[], int n, int workers, size_t heapsize)
+	{
+		sched_t s;
+		int     src[COMM_NUM_CHANNELS], dst[COMM_NUM_CHANNELS];
+
+		if(n <= 0)
+			return(0);
+		if(workers <= 0)
+			workers = sysconf(_SC_NPROCESSORS_ONLN);
+		if(workers <= 0)
+			workers = 1;
+
+		/* cores of all actors, in one thread and heap */
+		int  *cores  = malloc(n * sizeof(int)), ncores = 0;
+		void *heap   = malloc(heapsize);
+		s.actor      = calloc(n, sizeof(actor_t));
+		s.deque      = calloc(workers, sizeof(deque_t));
+		if(!cores || !heap || !s.actor || !s.deque)
+			FAIL("ERROR: can't allocate scheduler\n");
+
+		for(int i = 0; i < n; i++) {
+			int k;
+			for(k = 0; k < ncores && cores[k] != actors[i].core; k++);
+			if(k == ncores)
+				cores[ncores++] = actors[i].core;
+		}
+		comm_init_cores(channels, cores, ncores, heap, heapsize);
+		free(cores);
+
+		/* handles, and which actor feeds and drains each channel */
+		for(int c = 0; c < COMM_NUM_CHANNELS; c++)
+			src[c] = dst[c] = -1;
+		for(int i = 0; i < n; i++) {
+			comm_actor_t *def = &actors[i];
+			actor_t      *a   = &s.actor[i];
+
+			if(def->nin  > COMM_ACTOR_PORTS ||
+			   def->nout > COMM_ACTOR_PORTS)
+				FAIL("ERROR: actor %d has too many ports\n", i);
+
+			a->def = def;
+			for(int k = 0; k < def->nin; k++) {
+				int c = def->in[k].chan;
+				if(c < 0 || c >= COMM_NUM_CHANNELS ||
+				   channels[c].dst.core != def->core || dst[c] != -1)
+					FAIL("ERROR: actor %d: bad input channel "
+						"%d\n", i, c);
+				a->in[k] = channels[c].dst.dptr.ptr;
+				dst[c]   = i;
+			}
+			for(int k = 0; k < def->nout; k++) {
+				int c = def->out[k].chan;
+				if(c < 0 || c >= COMM_NUM_CHANNELS ||
+				   channels[c].src.core != def->core || src[c] != -1)
+					FAIL("ERROR: actor %d: bad output channel "
+						"%d\n", i, c);
+				a->out[k] = channels[c].src.dptr.ptr;
+				src[c]    = i;
+			}
+		}
+		for(int i = 0; i < n; i++)
+			for(int k = 0; k < actors[i].nout; k++)
+				s.actor[i].down[k] = dst[actors[i].out[k].chan];
+		for(int c = 0; c < COMM_NUM_CHANNELS; c++) {
+			if(src[c] != -1 && dst[c] != -1) {
+				actor_link(&s.actor[src[c]], dst[c]);
+				actor_link(&s.actor[dst[c]], src[c]);
+			}
+		}
+
+		/* deques, all actors start on the caller's */
+		for(int i = 0; i < workers; i++) {
+			s.deque[i].slot = malloc(n * sizeof(int));
+			s.deque[i].seed = i + 1;
+			if(!s.deque[i].slot)
+				FAIL("ERROR: can't allocate scheduler\n");
+			pthread_spin_init(&s.deque[i].lock,
+				PTHREAD_PROCESS_PRIVATE);
+		}
+		s.nactors  = n;
+		s.nworkers = workers;
+		s.done     = 0;
+		s.sleepers = 0;
+		pthread_mutex_init(&s.mutex, NULL);
+		pthread_cond_init(&s.cond, NULL);
+		for(int i = 0; i < n; i++)
+			actor_wake(&s, &s.deque[0], i);
+
+		/* caller is worker 0 */
+		pthread_t    threads[workers];
+		worker_arg_t args[workers];
+		for(int i = 0; i < workers; i++) {
+			args[i].s  = &s;
+			args[i].id = i;
+			if(i && pthread_create(&threads[i], NULL, worker, &args[i]))
+				FAIL("ERROR: can't create worker %d\n", i);
+		}
+		worker(&args[0]);
+		for(int i = 1; i < workers; i++)
+			pthread_join(threads[i], NULL);
+
+		for(int i = 0; i < workers; i++) {
+			pthread_spin_destroy(&s.deque[i].lock);
+			free(s.deque[i].slot);
+		}
+		pthread_mutex_destroy(&s.mutex);
+		pthread_cond_destroy(&s.cond);
+		free(s.deque);
+		free(s.actor);
+
+		/* NOTE: the heap holds the ports, it stays allocated */
+		return(0);
+	}
+#endif /* COMM_PTHREAD */
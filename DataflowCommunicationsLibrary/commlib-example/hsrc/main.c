@@ -1,6 +1,5 @@
 /* Host Application */
 #define _POSIX_SOURCE	/* sigaction */
-#define _BSD_SOURCE	/* usleep    */
 #define _GNU_SOURCE	/* pthread_tryjoin_np */
 
 #include <stdio.h>
@@ -19,32 +18,57 @@
 
 	#define COMM_HOST_HANDLE(CHANNELS) \
 		do { comm_host_handle(CHANNELS, &emem); } while(0);
+	#define COMM_HOST_FLUSH(CHANNELS) \
+		do { comm_host_flush(CHANNELS, &emem); } while(0);
+	#define COMM_HOST_WAIT(CHANNELS) \
+		do { comm_host_wait(CHANNELS, &emem); } while(0);
+	#define COMM_HOST_START(CHANNELS, CPUS) \
+		do { comm_host_start(CHANNELS, &emem, CPUS); } while(0);
 #endif
 
 #ifdef COMM_PTHREAD
 	#include <pthread.h>
+	#include <sched.h>
 	#include <errno.h>	/* EBUSY */
+	#include <fcntl.h>
+	#include <stdarg.h>
+	#include <sys/socket.h>
+	#include <sys/stat.h>
+	#include <sys/un.h>
 
 	#define COMM_HOST_HANDLE(CHANNELS) \
 		do { comm_host_handle(CHANNELS, &shm); } while(0);
+	#define COMM_HOST_FLUSH(CHANNELS) \
+		do { comm_host_flush(CHANNELS, &shm); } while(0);
+	#define COMM_HOST_WAIT(CHANNELS) \
+		do { comm_host_wait(CHANNELS, &shm); } while(0);
+	#define COMM_HOST_START(CHANNELS, CPUS) \
+		do { comm_host_start(CHANNELS, &shm, CPUS); } while(0);
 #endif
 
 #include "../commlib.h"
 #include "../shared.h"
 
 /* global stuff */
-shm_t shm;
+#ifdef COMM_EPIPHANY
+	shm_t shm;
+#endif
+#ifdef COMM_PTHREAD
+	shm_t *shm_ptr;		/* see main() */
+	#define shm (*shm_ptr)
+#endif
 #define FAIL(...)   do { fprintf(stderr, __VA_ARGS__); exit(1); } while(0);
 #define PRINTF(...) do { fprintf(stderr, __VA_ARGS__);          } while(0);
 volatile int sigquit_flag = 0;
 void sigquit(int param) { sigquit_flag = 1; }
+static int server = -1;	/* listening socket, server mode (pthreads) */
 
 /* commlib channel table */
 #define TOKEN_NUM  2
 #define TOKEN_SIZE (MSIZE * sizeof(float))
 comm_channel_t channels[COMM_NUM_CHANNELS] = {
 	/* input chain */
-	HOST_INPUT("input.bin", 15, input_buf,
+	HOST_INPUT_MMAP("input.bin", 15, input_buf,
 		((HOSTBUFSIZE-128)/TOKEN_SIZE), TOKEN_SIZE),	/*  0 */
 	DEFAULT(15, 14, TOKEN_NUM, TOKEN_SIZE),			/*  1 */
 	DEFAULT(14, 13, TOKEN_NUM, TOKEN_SIZE),			/*  2 */
@@ -63,8 +87,9 @@ comm_channel_t channels[COMM_NUM_CHANNELS] = {
 	DEFAULT( 7, 11, TOKEN_NUM, TOKEN_SIZE),			/* 15 */
 
 	/* output chain */
-	HOST_OUTPUT(15, "output.bin", output_buf,
-		((HOSTBUFSIZE-128)/TOKEN_SIZE), TOKEN_SIZE),	/* 16 */
+	HOST_OUTPUT_EX(15, "output.bin", output_buf,
+		((HOSTBUFSIZE-128)/TOKEN_SIZE), TOKEN_SIZE,
+		COMM_HOST_ASYNC),				/* 16 */
 	DEFAULT(14, 15, TOKEN_NUM, TOKEN_SIZE),			/* 17 */
 	DEFAULT(13, 14, TOKEN_NUM, TOKEN_SIZE),			/* 18 */
 	DEFAULT(12, 13, TOKEN_NUM, TOKEN_SIZE),			/* 19 */
@@ -96,6 +121,8 @@ comm_channel_t channels[COMM_NUM_CHANNELS] = {
 	};
 #endif
 #ifdef COMM_PTHREAD
+	extern int   affinity_map(comm_channel_t[], int, int[]);
+	extern void  affinity_host(comm_channel_t[], int, const int[], int[]);
 	extern void* householder_entry(void*);
 
 	void*(*kernels[CORES])(void*) = {
@@ -110,14 +137,311 @@ comm_channel_t channels[COMM_NUM_CHANNELS] = {
 	};
 #endif
 
+#ifdef COMM_FIBER
+	/* fiber thread 't' runs logical cores t, t+FIBER_THREADS, ... */
+	static void core_fiber(void *id)
+	{
+		kernels[(intptr_t)id](id);
+	}
+
+	static void* fiber_thread(void *arg)
+	{
+		intptr_t t = (intptr_t)arg;
+		void    *ids[CORES];
+		int      n = 0;
+
+		for(intptr_t i = t; i < CORES; i += FIBER_THREADS)
+			ids[n++] = (void*)i;
+		comm_fiber_run(core_fiber, ids, n, FIBER_STACK);
+		return(NULL);
+	}
+#endif
+
+#ifdef COMM_PROCESS
+	#include <sys/prctl.h>
+	#include <sys/resource.h>
+	#include <sys/wait.h>
+
+	pid_t pids[CORES];
+
+	/* fork logical core 'i', pinned to 'cpu' (or not, if -1) */
+	static pid_t core_spawn(int i, int cpu)
+	{
+		pid_t pid = fork();
+		if(pid != 0)
+			return(pid);
+
+		/* leave with the host, leave SIGQUIT (dump) to the host */
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+		signal(SIGQUIT, SIG_IGN);
+
+		if(cpu >= 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+		if(CORE_MEMLIMIT) {
+			struct rlimit rl = { CORE_MEMLIMIT, CORE_MEMLIMIT };
+			setrlimit(RLIMIT_DATA, &rl);
+		}
+
+		kernels[i]((void*)(intptr_t)i);
+		exit(0);
+	}
+
+	/* fail if a core process crashed or gave up */
+	static void core_check(void)
+	{
+		int   status;
+		pid_t pid;
+
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			int i;
+			for(i = 0; i < CORES && pids[i] != pid; i++)
+				;
+			if(i < CORES)
+				pids[i] = 0;
+			if(WIFEXITED(status) && WEXITSTATUS(status) == 0)
+				continue;
+
+			for(int k = 0; k < CORES; k++)
+				if(pids[k] > 0)
+					kill(pids[k], SIGKILL);
+			if(WIFSIGNALED(status))
+				FAIL("\nCore %d killed by signal %d.\n", i,
+					WTERMSIG(status));
+			FAIL("\nCore %d failed, status %d.\n", i,
+				WEXITSTATUS(status));
+		}
+	}
+#endif
+
+#ifdef COMM_PTHREAD
+	/* server mode: the cores stay up and run jobs back-to-back. A job
+	   is a line on the unix socket naming one file per host channel,
+	   in table order ("input.bin output.bin"), or "quit"; it is
+	   answered by "ok JOB STATUS MS" or "error: ..." */
+	static const char      *server_path;
+	static int             client = -1;
+	static uint32_t        job_num = 0;
+	static struct timespec job_t0;
+
+	static comm_ctype_host_dsc_t* host_desc(comm_channel_t *ch)
+	{
+		return((ch->src.core == -1) ? ch->src.hptr.ptr : ch->dst.hptr.ptr);
+	}
+
+	static void server_open(const char *path)
+	{
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		struct stat        st;
+
+		if(strlen(path) >= sizeof(addr.sun_path))
+			FAIL("Socket path '%s' too long!\n", path);
+		strcpy(addr.sun_path, path);
+
+		/* replace a stale socket, nothing else */
+		if(!stat(path, &st) && S_ISSOCK(st.st_mode))
+			unlink(path);
+		server = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(server == -1 ||
+		   bind(server, (struct sockaddr*)&addr, sizeof(addr)) ||
+		   listen(server, 4))
+			FAIL("Can't serve on '%s': %s\n", path, strerror(errno));
+		server_path = path;
+
+		/* host channels get their files from the jobs */
+		for(int i = 0; i < COMM_NUM_CHANNELS; i++)
+			if(shm.channels[i].type == COMM_CTYPE_HOST)
+				host_desc(&shm.channels[i])->file = NULL;
+		shm.server = 1;
+		PRINTF("Serving jobs on '%s'.\n", path);
+	}
+
+	static void server_close(void)
+	{
+		if(client != -1)
+			close(client);
+		close(server);
+		unlink(server_path);
+	}
+
+	static void job_reply(const char *fmt, ...)
+	{
+		char    buf[256];
+		va_list ap;
+
+		va_start(ap, fmt);
+		int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+		va_end(ap);
+		if(len > (int)sizeof(buf) - 1)
+			len = sizeof(buf) - 1;
+
+		/* client may be gone, the next job comes from another one */
+		if(client != -1 && send(client, buf, len, MSG_NOSIGNAL) != len) {
+			close(client);
+			client = -1;
+		}
+	}
+
+	/* next line from a client, accepting one if needed */
+	static void job_line(char *buf, size_t size)
+	{
+		size_t len = 0;
+
+		for(;;) {
+			char c;
+
+			if(client == -1) {
+				client = accept(server, NULL, NULL);
+				if(client == -1 && errno != EINTR)
+					FAIL("Can't accept job: %s\n", strerror(errno));
+				len = 0;
+				continue;
+			}
+
+			ssize_t n = read(client, &c, 1);
+			if(n == -1 && errno == EINTR)
+				continue;
+			if(n <= 0) {
+				close(client);
+				client = -1;
+				continue;
+			}
+
+			if(c == '\n')
+				break;
+			if(c != '\r' && len < size - 1)
+				buf[len++] = c;
+		}
+		buf[len] = '\0';
+	}
+
+	/* 'name' can be opened for channel 'ch'; outputs are created */
+	static int job_file(comm_channel_t *ch, const char *name)
+	{
+		if(ch->src.core == -1)
+			return(!strcmp(name, "stdin") || !access(name, R_OK));
+
+		if(!strcmp(name, "stdout"))
+			return(1);
+		int fd = open(name, O_WRONLY | O_CREAT, 0666);
+		if(fd == -1)
+			return(0);
+		close(fd);
+		return(1);
+	}
+
+	/* wait for the next job and start it, 0 on quit */
+	static int job_next(const int cpus[])
+	{
+		char line[4096], *name[COMM_NUM_CHANNELS], *save;
+		int  hosts[COMM_NUM_CHANNELS], nhosts = 0;
+
+		for(int i = 0; i < COMM_NUM_CHANNELS; i++)
+			if(shm.channels[i].type == COMM_CTYPE_HOST)
+				hosts[nhosts++] = i;
+
+		for(;;) {
+			int n = 0, k;
+
+			job_line(line, sizeof(line));
+			for(char *t = strtok_r(line, " \t", &save);
+			    t && n < COMM_NUM_CHANNELS;
+			    t = strtok_r(NULL, " \t", &save))
+				name[n++] = t;
+
+			if(n == 0)
+				continue;
+			if(n == 1 && !strcmp(name[0], "quit")) {
+				shm.job = JOB_QUIT;
+				return(0);
+			}
+			if(n != nhosts) {
+				job_reply("error: need %d files\n", nhosts);
+				continue;
+			}
+			for(k = 0; k < n && job_file(&shm.channels[hosts[k]],
+				name[k]); k++);
+			if(k < n) {
+				job_reply("error: can't open '%s': %s\n", name[k],
+					strerror(errno));
+				continue;
+			}
+			break;
+		}
+
+		/* open the files, fill the inputs, let the cores run */
+		clock_gettime(CLOCK_MONOTONIC, &job_t0);
+		for(int k = 0; k < nhosts; k++) {
+			comm_ctype_host_dsc_t *desc = host_desc(&shm.channels[hosts[k]]);
+			free(desc->file);
+			desc->file = strdup(name[k]);
+		}
+		shm.flag = 0;
+		comm_host_init(shm.channels);
+		COMM_HOST_HANDLE(shm.channels);
+		PRINTF("\r\033[0K");
+
+		shm.job = ++job_num;
+		COMM_HOST_START(shm.channels, cpus);
+		return(1);
+	}
+
+	/* after the flush: wait for the cores to reset, then empty the
+	   host channels and answer */
+	static void job_done(void)
+	{
+		struct timespec t1;
+
+		while(shm.ready != job_num) {
+		#ifdef COMM_PROCESS
+			core_check();
+		#endif
+			usleep(JOB_POLL);
+		}
+		comm_host_close(shm.channels, &shm);
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		job_reply("ok %u %u %.3f\n", job_num, shm.flag,
+			(t1.tv_sec - job_t0.tv_sec) * 1e3 +
+			(t1.tv_nsec - job_t0.tv_nsec) / 1e6);
+	}
+#endif
+
 /* main program */
 int main(int argc, char *argv[])
 {
 	struct sigaction sigquitaction;
 
+	/* usage */
+#ifdef COMM_PTHREAD
+	int serve = (argc == 3 && !strcmp(argv[1], "-s"));
+#else
+	int serve = 0;
+#endif
+	if(argc != 1 && !serve) {
+		PRINTF("Usage: %s [-s SOCKET]\n", argv[0]);
+		PRINTF("  -s: keep the cores up, run jobs sent to a unix "
+			"socket (pthreads)\n");
+		return(1);
+	}
+
+#ifdef COMM_PTHREAD
+	/* allocate shared memory structure */
+	shm_ptr = comm_host_alloc(sizeof(shm_t));
+	if(!shm_ptr)
+		FAIL("Can't allocate shm!\n");
+#endif
+
 	/* initialize shared memory structure */
 	memset(&shm, 0, sizeof(shm_t));
 	memcpy(&shm.channels, &channels, sizeof(shm.channels));
+#ifdef COMM_PTHREAD
+	if(serve)
+		server_open(argv[2]);
+#endif
 	comm_host_init(shm.channels);
 
 #ifdef COMM_EPIPHANY
@@ -154,11 +478,72 @@ int main(int argc, char *argv[])
 #endif
 
 #ifdef COMM_PTHREAD
-	/* start threads */
+	/* map logical cores to cpus */
+	int cpus[CORES];
+	int pinned = affinity_map(shm.channels, CORES, cpus);
+
+	/* host channel threads on spare cpus near their cores */
+	int hostcpus[COMM_NUM_CHANNELS];
+	if(pinned)
+		affinity_host(shm.channels, CORES, cpus, hostcpus);
+#endif
+
+#ifdef COMM_PROCESS
+	/* start core processes, pinned before they touch any memory */
+	fflush(NULL);
+	for(int i = 0; i < CORES; i++) {
+		if(pinned)
+			PRINTF("Core %2d: cpu %2d\n", i, cpus[i]);
+		pids[i] = core_spawn(i, pinned ? cpus[i] : -1);
+		if(pids[i] == -1)
+			FAIL("Can't create process (%i)\n", i);
+	}
+#elif defined COMM_FIBER
+	/* start fiber threads, each pinned like its first core */
+	pthread_t threads[FIBER_THREADS];
+	for(int i = 0; i < FIBER_THREADS; i++) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if(pinned) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+			PRINTF("Fibers %2d: cpu %2d\n", i, cpus[i]);
+		}
+		if(pthread_create(&threads[i], &attr, fiber_thread,
+			(void*)(intptr_t)i))
+			FAIL("Can't create thread (%i)\n", i);
+		pthread_attr_destroy(&attr);
+	}
+#elif defined COMM_PTHREAD
+	/* start threads, pinned before they touch any memory */
 	pthread_t threads[CORES];
-	for(int i = 0; i < CORES; i++)
-		if(pthread_create(&threads[i], NULL, kernels[i], (void*)i))
+	for(int i = 0; i < CORES; i++) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if(pinned) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+			PRINTF("Core %2d: cpu %2d\n", i, cpus[i]);
+		}
+		if(pthread_create(&threads[i], &attr, kernels[i],
+			(void*)(intptr_t)i))
 			FAIL("Can't create thread (%i)\n", i);
+		pthread_attr_destroy(&attr);
+	}
+#endif
+
+#ifdef COMM_PTHREAD
+	/* serve host channels from worker threads, near their cores */
+	COMM_HOST_START(shm.channels, pinned ? hostcpus : NULL);
+#endif
+
+#ifdef COMM_EPIPHANY
+	/* serve host channels from worker threads */
+	COMM_HOST_START(shm.channels, NULL);
 #endif
 
 	/* install signal handler */
@@ -167,41 +552,59 @@ int main(int argc, char *argv[])
 		FAIL("Can't install SIGQUIT handler!\n");
 
 	/* ============================================================= */
-	PRINTF("Polling shared memory. Press CTRL+\\ to dump state.\n");
-	while(1) {
-		/* check if SIGQUIT happened and handle it */
-		if(sigquit_flag) {
-			#if COMM_EPIPHANY
-				e_read(&emem,0,0,(off_t)0, &shm, sizeof(shm));
-				comm_host_dump(shm.channels);
-				epiphany_dump(&dev, kernels);
-			#else
-				comm_host_dump(shm.channels);
-			#endif
+	do {
+	#ifdef COMM_PTHREAD
+		/* server mode: next job, or quit */
+		if(server != -1 && !job_next(pinned ? hostcpus : NULL))
+			break;
+	#endif
 
-			sigquit_flag = 0;
-			sigaction(SIGQUIT, &sigquitaction, NULL);
-		}
+		PRINTF("Polling shared memory. Press CTRL+\\ to dump state.\n");
+		while(1) {
+			/* check if SIGQUIT happened and handle it */
+			if(sigquit_flag) {
+				#if COMM_EPIPHANY
+					e_read(&emem,0,0,(off_t)0, &shm, sizeof(shm));
+					comm_host_dump(shm.channels);
+					epiphany_dump(&dev, kernels);
+				#else
+					comm_host_dump(shm.channels);
+				#endif
 
-		/* handle commlib channels */
-		COMM_HOST_HANDLE(shm.channels);
+				sigquit_flag = 0;
+				sigaction(SIGQUIT, &sigquitaction, NULL);
+			}
 
-		#ifdef COMM_EPIPHANY
-			/* read flag from shared memory */
-			if(e_read(&emem, 0, 0, (off_t)0, &shm,
-				sizeof(uint32_t)) == E_ERR)
-					FAIL("Can't poll!\n");
-		#endif
+			/* handle commlib channels */
+			COMM_HOST_HANDLE(shm.channels);
 
-		/* check if flag set */
-		if(shm.flag != 0)
-			break;
+			#ifdef COMM_EPIPHANY
+				/* read flag from shared memory */
+				if(e_read(&emem, 0, 0, (off_t)0, &shm,
+					sizeof(uint32_t)) == E_ERR)
+						FAIL("Can't poll!\n");
+			#endif
 
-		usleep(10000);
-	}
+			/* check if flag set or all output streams ended */
+			if(shm.flag != 0 || comm_host_done(shm.channels))
+				break;
 
-	COMM_HOST_HANDLE(shm.channels);
-	PRINTF("\nProgram finished, status = %u [0x%x].\n", shm.flag, shm.flag);
+			#ifdef COMM_PROCESS
+				core_check();
+			#endif
+
+			/* sleep until channels need service */
+			COMM_HOST_WAIT(shm.channels);
+		}
+
+		COMM_HOST_FLUSH(shm.channels);
+		PRINTF("\nProgram finished, status = %u [0x%x].\n", shm.flag, shm.flag);
+
+	#ifdef COMM_PTHREAD
+		if(server != -1)
+			job_done();
+	#endif
+	} while(server != -1);
 	/* ============================================================= */
 
 	/* uninstall signal handler */
@@ -209,6 +612,27 @@ int main(int argc, char *argv[])
 	if(sigaction(SIGQUIT, &sigquitaction, NULL))
 		FAIL("Can't uninstall SIGQUIT handler!\n");
 
+#ifdef COMM_PTHREAD
+	if(server != -1)
+		server_close();
+#endif
+
+#ifdef COMM_PROCESS
+	/* cores still running have nothing left to do */
+	for(int i = 0; i < CORES; i++)
+		if(pids[i] > 0)
+			kill(pids[i], SIGKILL);
+	while(wait(NULL) > 0)
+		;
+#elif defined COMM_FIBER
+	for(int i = 0; i < FIBER_THREADS; i++)
+		pthread_join(threads[i], NULL);
+#elif defined COMM_PTHREAD
+	/* cores return once their streams are closed */
+	for(int i = 0; i < CORES; i++)
+		pthread_join(threads[i], NULL);
+#endif
+
 #ifdef COMM_EPIPHANY
 	/* read full shared memory structure */
 	if(e_read(&emem, 0, 0, (off_t)0, &shm, sizeof(shm_t)) == E_ERR)
@@ -220,5 +644,6 @@ int main(int argc, char *argv[])
 	if(e_finalize()  != E_OK) FAIL("Can't e_finalize()!\n");
 #endif
 
-	return(0);
+	/* single stream: fail if it did not run to the end */
+	return((serve || shm.flag == FLAG_DONE) ? 0 : 1);
 }
@@ -27,13 +27,44 @@
 /* host channel size, must be large enough for buffers */
 #define HOSTBUFSIZE (1024*1024)
 
+/* host channel alignment, page aligned buffers share no pages with
+   other data (COMM_HOST_DIRECT, COMM_HOST_SPLICE) */
+#define HOSTBUFALIGN 4096
+
+/* core processes (COMM_PROCESS): private memory limit, 0 for none */
+#define CORE_MEMLIMIT (256*1024*1024)
+
+/* core fibers (COMM_FIBER): threads to share, stack per core */
+#define FIBER_THREADS 2
+#define FIBER_STACK   (256*1024)
+
+/* server mode (pthreads): jobs count from 1, JOB_QUIT stops the cores;
+   idle cores check for the next job every JOB_POLL microseconds */
+#define JOB_QUIT 0xffffffff
+#define JOB_POLL 100
+
+/* shm.flag, set by the first core when it stops */
+#define FLAG_DONE  1
+#define FLAG_SHORT 2	/* input ended early, output incomplete */
+
 /* shared memory definition */
 typedef struct {
 	uint32_t       ALIGN(8) flag;
 	comm_channel_t ALIGN(8) channels[COMM_NUM_CHANNELS];
-	uint8_t        ALIGN(8) input_buf[HOSTBUFSIZE];
-	uint8_t        ALIGN(8) output_buf[HOSTBUFSIZE];
+	uint8_t        ALIGN(HOSTBUFALIGN) input_buf[HOSTBUFSIZE];
+	uint8_t        ALIGN(HOSTBUFALIGN) output_buf[HOSTBUFSIZE];
 	uint32_t timers[CORES][10];
+#ifdef COMM_PTHREAD
+	comm_barrier_t barrier;		/* core barrier, zeroed by host */
+#endif
+	volatile uint32_t server;	/* cores run jobs until JOB_QUIT */
+	volatile uint32_t job;		/* server: job to run */
+	volatile uint32_t ready;	/* server: last job done, cores reset */
 } ALIGN(8) shm_t;
 
+#ifdef COMM_PTHREAD
+	/* allocated at run-time by comm_host_alloc() */
+	extern shm_t *shm_ptr;
+#endif
+
 #endif /* _SHARED_H_ */
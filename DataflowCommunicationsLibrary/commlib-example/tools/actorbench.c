@@ -0,0 +1,88 @@
+/* Host Actor Benchmark (pthreads only)
+   host thread -> kernel thread -> host thread, all over DEFAULT channels;
+   the host ends join the graph with comm_host_attach(), no files involved */
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+/* logical cores */
+#define KERNEL   0
+#define PRODUCER 1	/* host actor */
+#define CONSUMER 2	/* host actor, main thread */
+
+static long tokens = 1L << 20;
+
+/* host actor: produce tokens in memory */
+static void* producer(void *arg)
+{
+	uint32_t token[TOKEN_SIZE / 4] = { 0 };
+
+	comm_host_attach(shm.channels, PRODUCER, HEAPSIZE);
+	comm_handle_t out = comm_get_whandle(0);
+
+	for(long i = 0; i < tokens; i++) {
+		token[0] = i;
+		comm_write(out, token, 1);
+	}
+
+	return(NULL);
+}
+
+/* device kernel: scale first word of each token */
+static void* kernel(void *arg)
+{
+	uint32_t token[TOKEN_SIZE / 4];
+
+	comm_init(shm.channels, KERNEL, heap, sizeof(heap));
+	comm_handle_t in  = comm_get_rhandle(0);
+	comm_handle_t out = comm_get_whandle(1);
+
+	for(long i = 0; i < tokens; i++) {
+		comm_read(in, token, 1);
+		token[0] *= 3;
+		comm_write(out, token, 1);
+	}
+
+	return(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t token[TOKEN_SIZE / 4];
+
+	USAGE(argc > 2, "Stream tokens from a host actor through a kernel "
+		"back to a host actor", "%s [tokens]\n", argv[0]);
+	if(argc > 1) tokens = atol(argv[1]);
+
+	/* host actor -> kernel -> host actor */
+	comm_channel_t chain[2] = {
+		DEFAULT(PRODUCER, KERNEL,   TOKEN_NUM, TOKEN_SIZE),
+		DEFAULT(KERNEL,   CONSUMER, TOKEN_NUM, TOKEN_SIZE),
+	};
+	memset(&shm, 0, sizeof(shm_t));
+	memcpy(shm.channels, chain, sizeof(chain));
+
+	pthread_t threads[2];
+	if(pthread_create(&threads[0], NULL, kernel,   NULL) ||
+	   pthread_create(&threads[1], NULL, producer, NULL))
+		FAIL("Can't create threads\n");
+
+	/* main thread is the consuming host actor */
+	comm_host_attach(shm.channels, CONSUMER, HEAPSIZE);
+	comm_handle_t in = comm_get_rhandle(1);
+
+	double t0 = bench_time();
+	for(long i = 0; i < tokens; i++) {
+		comm_read(in, token, 1);
+		if(token[0] != (uint32_t)i * 3)
+			FAIL("Token %ld corrupted\n", i);
+	}
+	double secs = bench_time() - t0;
+
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+
+	bench_report("host -> kernel -> host", tokens, secs);
+
+	return(0);
+}
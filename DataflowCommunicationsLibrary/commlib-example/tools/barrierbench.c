@@ -0,0 +1,74 @@
+/* Barrier Benchmark (pthreads only)
+   threads pass a barrier over and over, either comm_barrier() or
+   pthread_barrier_wait(); reports the time per round */
+#define _GNU_SOURCE
+
+#define HEAPSIZE 1024
+
+#include "bench.h"
+
+static long rounds  = 100000;
+static int  threads = 4;
+static int  posix   = 0;	/* use pthread_barrier_wait() */
+
+static pthread_barrier_t barrier;
+static volatile long     counter[CORES];	/* checks each round */
+
+static void* worker(void *arg)
+{
+	int id = (intptr_t)arg;
+
+	/* no channels, comm_barrier() needs the core id only */
+	comm_init(shm.channels, id, heap, sizeof(heap));
+
+	for(long r = 0; r < rounds; r++) {
+		counter[id] = r;
+		if(posix)
+			pthread_barrier_wait(&barrier);
+		else
+			comm_barrier(&shm.barrier, threads);
+
+		/* everybody arrived in this round, nobody left it */
+		if(counter[(id + 1) % threads] != r)
+			FAIL("Thread %d passed early in round %ld\n", id, r);
+
+		if(posix)
+			pthread_barrier_wait(&barrier);
+		else
+			comm_barrier(&shm.barrier, threads);
+	}
+
+	return(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t tid[CORES];
+
+	USAGE(argc > 4, "Pass threads through a barrier",
+		"%s [rounds] [threads, max. %d] [comm | posix]\n",
+		argv[0], CORES);
+	if(argc > 1) rounds  = atol(argv[1]);
+	if(argc > 2) threads = atoi(argv[2]);
+	if(argc > 3) posix   = !strcmp(argv[3], "posix");
+	if(threads < 1 || threads > CORES)
+		FAIL("Need 1 to %d threads\n", CORES);
+
+	memset(&shm, 0, sizeof(shm_t));
+	pthread_barrier_init(&barrier, NULL, threads);
+
+	double t0 = bench_time();
+	for(int i = 0; i < threads; i++)
+		if(pthread_create(&tid[i], NULL, worker, (void*)(intptr_t)i))
+			FAIL("Can't create threads\n");
+	for(int i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	double secs = bench_time() - t0;
+
+	printf("%s, %d threads | %ld barriers in %.3f s | %.2f us each\n",
+		posix ? "pthread_barrier_wait" : "comm_barrier", threads,
+		2 * rounds, secs, secs * 1e6 / (2 * rounds));
+
+	pthread_barrier_destroy(&barrier);
+	return(0);
+}
@@ -0,0 +1,63 @@
+/* Benchmark Header (pthreads only)
+   what the benchmarks in tools/ share: messages, the commlib globals, a
+   heap per thread, usage, timing and the throughput report. A benchmark
+   may set TOKEN_NUM, TOKEN_SIZE and HEAPSIZE before including it */
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../commlib.h"
+#include "../shared.h"
+
+#define FAIL(...)   do { fprintf(stderr, __VA_ARGS__); exit(1); } while(0);
+#define PRINTF(...) do { fprintf(stderr, __VA_ARGS__);          } while(0);
+
+/* print what the benchmark does and its usage, then stop,
+   if 'cond' holds */
+#define USAGE(cond, what, ...) do { \
+		if(cond) { \
+			PRINTF("%s\n", what); \
+			PRINTF("Usage: " __VA_ARGS__); \
+			exit(1); \
+		} \
+	} while(0)
+
+/* benchmark parameters */
+#ifndef TOKEN_NUM
+#define TOKEN_NUM  64
+#endif
+#ifndef TOKEN_SIZE
+#define TOKEN_SIZE 64
+#endif
+#ifndef HEAPSIZE
+#define HEAPSIZE   (2 * TOKEN_NUM * TOKEN_SIZE + 1024)
+#endif
+
+static shm_t shm;
+shm_t *shm_ptr = &shm;	/* required by commlib */
+
+/* for comm_init() of the calling thread */
+static __thread char heap[HEAPSIZE];
+
+/* monotonic time in seconds */
+static inline double bench_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* report 'tokens' of TOKEN_SIZE bytes moved in 'secs' */
+static inline void bench_report(const char *what, long tokens, double secs)
+{
+	printf("%s | %ld tokens in %.3f s | %.1f MB/s\n",
+		what, tokens, secs, tokens * TOKEN_SIZE / secs / 1e6);
+}
+
+#endif /* _BENCH_H_ */
@@ -0,0 +1,127 @@
+/* Ring Buffer Benchmark (pthreads only)
+   streams tokens over one DEFAULT channel between two pinned threads,
+   reports throughput and the NUMA nodes of consumer and ring buffer */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#include "bench.h"
+
+/* get_mempolicy()/mbind() constants, see <numaif.h> */
+#define MPOL_BIND    2
+#define MPOL_F_NODE  (1<<0)
+#define MPOL_F_ADDR  (1<<1)
+#define MPOL_MF_MOVE (1<<1)
+
+static int  cpus[2];		/* producer, consumer */
+static int  ring_node = -1;	/* force ring onto this node */
+static long tokens    = 1L << 22;
+
+/* NUMA node of the page containing 'addr' */
+static int node_of(void *addr)
+{
+	int node = -1;
+	if(syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+		MPOL_F_NODE | MPOL_F_ADDR))
+			return(-1);
+	return(node);
+}
+
+/* migrate the pages containing [addr, addr+len) to 'node' */
+static void move_to(void *addr, size_t len, int node)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)addr & ~(page - 1);
+	uintptr_t end   = ((uintptr_t)addr + len + page - 1) & ~(page - 1);
+	unsigned long mask = 1UL << node;
+
+	if(syscall(SYS_mbind, start, end - start, MPOL_BIND, &mask,
+		sizeof(mask) * 8, MPOL_MF_MOVE))
+			PRINTF("WARNING: can't move ring to node %d\n", node);
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof(set), &set))
+		FAIL("Can't pin to cpu %d\n", cpu);
+}
+
+static void* producer(void *arg)
+{
+	uint8_t token[TOKEN_SIZE] = { 0 };
+
+	pin(cpus[0]);
+	comm_init(shm.channels, 0, heap, sizeof(heap));
+	comm_handle_t out = comm_get_whandle(0);
+
+	for(long i = 0; i < tokens; i++) {
+		token[0] = i;
+		comm_write(out, token, 1);
+	}
+
+	return(NULL);
+}
+
+static void* consumer(void *arg)
+{
+	uint8_t token[TOKEN_SIZE];
+	char    what[80];
+
+	pin(cpus[1]);
+	comm_init(shm.channels, 1, heap, sizeof(heap));
+	comm_handle_t in = comm_get_rhandle(0);
+	comm_cdefault_dst_t *port = in;
+
+	/* reproduce a remote placement, if requested */
+	if(ring_node >= 0)
+		move_to(port->buf, TOKEN_SIZE * (TOKEN_NUM + 1), ring_node);
+
+	double t0 = bench_time();
+	for(long i = 0; i < tokens; i++) {
+		comm_read(in, token, 1);
+		if(token[0] != (uint8_t)i)
+			FAIL("Token %ld corrupted\n", i);
+	}
+	double secs = bench_time() - t0;
+
+	snprintf(what, sizeof(what), "cpu %2d -> cpu %2d | consumer node %2d"
+		" | ring node %2d", cpus[0], cpus[1], node_of(&token),
+		node_of(port->buf));
+	bench_report(what, tokens, secs);
+
+	return(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	USAGE(argc < 3 || argc > 5,
+		"Measure DEFAULT channel throughput between two cpus",
+		"%s <src-cpu> <dst-cpu> [ring-node] [tokens]\n"
+		"  <ring-node>: move ring buffer to this node\n"
+		"               (-1: keep placement, default)\n", argv[0]);
+
+	cpus[0] = atoi(argv[1]);
+	cpus[1] = atoi(argv[2]);
+	if(argc > 3) ring_node = atoi(argv[3]);
+	if(argc > 4) tokens    = atol(argv[4]);
+
+	/* single channel, core 0 -> core 1 */
+	comm_channel_t channel = DEFAULT(0, 1, TOKEN_NUM, TOKEN_SIZE);
+	memset(&shm, 0, sizeof(shm_t));
+	shm.channels[0] = channel;
+
+	pthread_t threads[2];
+	if(pthread_create(&threads[0], NULL, producer, NULL) ||
+	   pthread_create(&threads[1], NULL, consumer, NULL))
+		FAIL("Can't create threads\n");
+
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+
+	return(0);
+}
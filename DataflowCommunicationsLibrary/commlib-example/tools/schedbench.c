@@ -0,0 +1,155 @@
+/* M:N Actor Benchmark (pthreads only)
+   source -> STAGES stages -> sink over DEFAULT channels, either as
+   actors on a pool of worker threads (comm_sched_run()) or with one
+   thread per actor blocking in comm_read()/comm_write() */
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+/* benchmark parameters */
+#define STAGES (COMM_NUM_CHANNELS - 1)
+#define ACTORS (STAGES + 2)
+#define RATE   16	/* tokens per firing */
+
+static long tokens = 1L << 20;
+
+/* actor state: core 'id' reads channel id-1, writes channel id */
+typedef struct {
+	int  id;
+	long count;	/* tokens done */
+} stage_t;
+
+static stage_t stage[ACTORS];
+
+static int source_fire(comm_handle_t in[], comm_handle_t out[], void *arg)
+{
+	stage_t *st = arg;
+	uint32_t token[RATE][TOKEN_SIZE / 4] = { { 0 } };
+
+	for(int k = 0; k < RATE; k++)
+		token[k][0] = st->count + k;
+	comm_write(out[0], token, RATE);
+
+	/* last firing ends the stream */
+	st->count += RATE;
+	if(st->count < tokens)
+		return(0);
+	comm_close_write(out[0]);
+	return(1);
+}
+
+/* stages and sink stop at the end of stream, passing it on */
+static int stage_fire(comm_handle_t in[], comm_handle_t out[], void *arg)
+{
+	stage_t *st = arg;
+	uint32_t token[RATE][TOKEN_SIZE / 4];
+
+	if(comm_read(in[0], token, RATE) == COMM_EOS) {
+		comm_close_write(out[0]);
+		return(1);
+	}
+	for(int k = 0; k < RATE; k++)
+		token[k][0]++;
+	comm_write(out[0], token, RATE);
+
+	st->count += RATE;
+	return(0);
+}
+
+static int sink_fire(comm_handle_t in[], comm_handle_t out[], void *arg)
+{
+	stage_t *st = arg;
+	uint32_t token[RATE][TOKEN_SIZE / 4];
+
+	if(comm_read(in[0], token, RATE) == COMM_EOS)
+		return(1);
+	for(int k = 0; k < RATE; k++)
+		if(token[k][0] != (uint32_t)(st->count + k + STAGES))
+			FAIL("Token %ld corrupted\n", st->count + k);
+
+	st->count += RATE;
+	return(0);
+}
+
+static comm_firefn_t fire_of(int id)
+{
+	return(!id ? source_fire : (id == ACTORS - 1) ? sink_fire : stage_fire);
+}
+
+/* thread per actor: fire until done, blocking in the channels */
+static void* actor_thread(void *arg)
+{
+	stage_t *st = arg;
+	comm_handle_t in[1] = { NULL }, out[1] = { NULL };
+
+	comm_init(shm.channels, st->id, heap, sizeof(heap));
+	if(st->id > 0)
+		in[0]  = comm_get_rhandle(st->id - 1);
+	if(st->id < ACTORS - 1)
+		out[0] = comm_get_whandle(st->id);
+
+	while(!fire_of(st->id)(in, out, st));
+	return(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	char what[80];
+	int  workers = 0;
+
+	USAGE(argc > 3, "Stream tokens through a pipeline of actors",
+		"%s [tokens] [workers, 0: one per CPU, "
+		"-1: one thread per actor]\n", argv[0]);
+	if(argc > 1) tokens  = atol(argv[1]) / RATE * RATE;
+	if(argc > 2) workers = atoi(argv[2]);
+
+	/* source -> stages -> sink */
+	memset(&shm, 0, sizeof(shm_t));
+	for(int c = 0; c < ACTORS - 1; c++) {
+		comm_channel_t ch = DEFAULT(c, c + 1, TOKEN_NUM, TOKEN_SIZE);
+		memcpy(&shm.channels[c], &ch, sizeof(ch));
+	}
+
+	comm_actor_t actors[ACTORS];
+	memset(actors, 0, sizeof(actors));
+	for(int i = 0; i < ACTORS; i++) {
+		stage[i].id    = i;
+		stage[i].count = 0;
+
+		actors[i].fire = fire_of(i);
+		actors[i].arg  = &stage[i];
+		actors[i].core = i;
+		if(i > 0) {
+			actors[i].nin     = 1;
+			actors[i].in[0]   = (comm_aport_t){ i - 1, RATE };
+		}
+		if(i < ACTORS - 1) {
+			actors[i].nout    = 1;
+			actors[i].out[0]  = (comm_aport_t){ i, RATE };
+		}
+	}
+
+	double t0 = bench_time();
+	if(workers >= 0) {
+		comm_sched_run(shm.channels, actors, ACTORS, workers,
+			ACTORS * HEAPSIZE);
+	} else {
+		pthread_t threads[ACTORS];
+		for(int i = 0; i < ACTORS; i++)
+			if(pthread_create(&threads[i], NULL, actor_thread,
+				&stage[i]))
+					FAIL("Can't create threads\n");
+		for(int i = 0; i < ACTORS; i++)
+			pthread_join(threads[i], NULL);
+	}
+	double secs = bench_time() - t0;
+	if(stage[ACTORS - 1].count != tokens)
+		FAIL("Sink got %ld of %ld tokens\n", stage[ACTORS - 1].count,
+			tokens);
+
+	snprintf(what, sizeof(what), "%d actors, %s", ACTORS,
+		(workers >= 0) ? "M:N workers" : "thread per actor");
+	bench_report(what, tokens, secs);
+
+	return(0);
+}
@@ -0,0 +1,97 @@
+/* Socket Channel Benchmark (pthreads only)
+   streams tokens over one SOCKET channel from a producer to a consumer;
+   the producer is a forked process for "unix:" and "tcp:" addresses and
+   a thread for "pair" */
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+#define BATCH 16	/* tokens per comm_write() and comm_read() */
+
+/* logical cores */
+#define PRODUCER 0
+#define CONSUMER 1
+
+static long tokens = 1L << 22;
+
+static void* producer(void *arg)
+{
+	uint32_t token[BATCH][TOKEN_SIZE / 4] = { { 0 } };
+
+	comm_init(shm.channels, PRODUCER, heap, sizeof(heap));
+	comm_handle_t out = comm_get_whandle(0);
+
+	for(long i = 0; i < tokens; i += BATCH) {
+		int n = (tokens - i < BATCH) ? tokens - i : BATCH;
+		for(int k = 0; k < n; k++)
+			token[k][0] = i + k;
+		comm_write(out, token, n);
+	}
+	comm_close_write(out);
+
+	return(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t token[BATCH][TOKEN_SIZE / 4];
+	char *addr = "unix:/tmp/sockbench.sock";
+	pthread_t thread;
+	pid_t pid = 0;
+
+	USAGE(argc > 3, "Stream tokens over a socket channel",
+		"%s [tokens] [unix:PATH | tcp:HOST:PORT | pair]\n", argv[0]);
+	if(argc > 1) tokens = atol(argv[1]);
+	if(argc > 2) addr   = argv[2];
+
+	comm_channel_t chain[1] = {
+		SOCKET(PRODUCER, CONSUMER, TOKEN_NUM, TOKEN_SIZE, addr),
+	};
+	memset(&shm, 0, sizeof(shm_t));
+	memcpy(shm.channels, chain, sizeof(chain));
+
+	/* consumer listens in comm_init(), producer may start first */
+	if(!strcmp(addr, "pair")) {
+		if(pthread_create(&thread, NULL, producer, NULL))
+			FAIL("Can't create thread\n");
+	} else {
+		pid = fork();
+		if(pid < 0)
+			FAIL("Can't fork\n");
+		if(!pid) {
+			producer(NULL);
+			exit(0);
+		}
+	}
+
+	comm_init(shm.channels, CONSUMER, heap, sizeof(heap));
+	comm_handle_t in = comm_get_rhandle(0);
+
+	double t0 = bench_time();
+	for(long i = 0; i < tokens; i += BATCH) {
+		int n = (tokens - i < BATCH) ? tokens - i : BATCH;
+		comm_read(in, token, n);
+		for(int k = 0; k < n; k++)
+			if(token[k][0] != (uint32_t)(i + k))
+				FAIL("Token %ld corrupted\n", i + k);
+	}
+	if(comm_read(in, token, 1) != COMM_EOS)
+		FAIL("Stream not closed\n");
+	double secs = bench_time() - t0;
+
+	if(pid) {
+		int status;
+		waitpid(pid, &status, 0);
+		if(!WIFEXITED(status) || WEXITSTATUS(status))
+			FAIL("Producer failed\n");
+	} else {
+		pthread_join(thread, NULL);
+	}
+
+	bench_report(addr, tokens, secs);
+
+	return(0);
+}